@@ -4,6 +4,8 @@
 #include "Hardware.h"
 #include "Recorder.h"
 #include "Battery.h"
+#include "Config.h"
+#include "Task.h"
 #include <limits.h>
 
 #define hw Hardware::instance
@@ -35,6 +37,9 @@ int increment = 10;
 bool skipUpRelease = false;
 bool skipDownRelease = false;
 
+bool sweep(Task& task);
+Task sweepTask(sweep);
+
 ///////////////////////////////////////////////////////////////////////
 //
 // Code
@@ -70,10 +75,8 @@ void setFanDutyCycle(int dutyCycle)
     if (currentDutyCycle >= 0) {
         hw.digitalWrite(FAN_ENABLE_PIN, FAN_ON);
         fanController.setDutyCycle(dutyCycle);
-        battery.notifySystemActive(true);
     } else {
         hw.digitalWrite(FAN_ENABLE_PIN, FAN_OFF);
-        battery.notifySystemActive(false);
     }
     resetRecorder();
     serialPrintf("Duty cycle %d\r\n\r\n", dutyCycle);
@@ -112,7 +115,151 @@ void initializeSerial() {
     Serial.println("Off button: toggle sound");
     Serial.println("On button: toggle increment");
     Serial.println("Down button: decrease fan speed");
-    Serial.println("Up button: increase fan speed\n");
+    Serial.println("Up button: increase fan speed");
+    Serial.println("Hold the On button during reset: automatic fan sweep");
+    Serial.println("Hold the Down button during reset: calibrate the current sensor's zero point (charger disconnected)");
+    Serial.println("Hold the Up button during reset: calibrate the current sensor's gain (1 amp load on the fan connector)");
+    Serial.println("Hold the Off button during reset: calibrate the bandgap reference (VCC held at 5.000 volts)\n");
+}
+
+// The gain calibration load. Connect an electronic load, set to draw this much, in place of the fan.
+const long long GAIN_CALIBRATION_LOAD_MICRO_AMPS = 1000000LL;
+
+// The bandgap calibration supply. Power the board's 5 volt rail from a reference supply set to this, through the
+// ISP header's VCC pin, with the battery connector unplugged.
+const long BANDGAP_CALIBRATION_AVCC_MILLI_VOLTS = 5000L;
+
+// Measure the MCU's bandgap reference against the known supply, and save it in EEPROM.
+void calibrateBandgap()
+{
+    if (hw.calibrateBandgap(BANDGAP_CALIBRATION_AVCC_MILLI_VOLTS)) {
+        serialPrintf("Bandgap calibrated: %u mV", hw.getBandgapMilliVolts());
+    } else {
+        serialPrintf("Bandgap NOT calibrated. It came out outside 1000 to 1200 mV. Check the supply.");
+    }
+}
+
+void printCurrentCalibration(const char* what)
+{
+    CurrentCalibration calibration = hw.getCurrentCalibration();
+    serialPrintf("Current sensor %s: offset %d, gain %u/%u", what, calibration.offset, calibration.gain, CURRENT_GAIN_ONE);
+}
+
+// Find the current sensor's zero point, and save it in EEPROM. Only the board's own current may flow while we
+// do this, so the fan must be disabled, and the charger must be disconnected.
+void calibrateCurrentZero()
+{
+    if (battery.isCharging()) {
+        serialPrintf("Current sensor zero NOT calibrated. Disconnect the charger and try again.");
+        return;
+    }
+    hw.delay(2000); // let the fan spin down
+    hw.calibrateCurrentZero();
+    printCurrentCalibration("zero calibrated");
+}
+
+// Find the current sensor's gain, and save it in EEPROM. The operator has connected a load that draws
+// GAIN_CALIBRATION_LOAD_MICRO_AMPS in place of the fan. The board's own current flows as well.
+void calibrateCurrentGain()
+{
+    if (battery.isCharging()) {
+        serialPrintf("Current sensor gain NOT calibrated. Disconnect the charger and try again.");
+        return;
+    }
+    allLEDs(LED_OFF);
+    hw.digitalWrite(FAN_ENABLE_PIN, FAN_ON);
+    hw.delay(1000); // let the load settle
+    const bool calibrated = hw.calibrateCurrentGain(-(GAIN_CALIBRATION_LOAD_MICRO_AMPS + BOARD_IDLE_MICRO_AMPS));
+    hw.digitalWrite(FAN_ENABLE_PIN, FAN_OFF);
+    if (calibrated) {
+        printCurrentCalibration("gain calibrated");
+    } else {
+        serialPrintf("Current sensor gain NOT calibrated. The current was more than 10%% away from the load's.");
+    }
+}
+
+///////////////////////////////////////////////////////////////////////
+//
+// Automatic fan sweep
+//
+///////////////////////////////////////////////////////////////////////
+
+// The sweep steps the fan duty cycle from 0 to 100%. At each step it waits until the RPM stops changing,
+// then takes a series of readings, and writes one line of results. The result lines all begin with "sweep,"
+// so they're easy to pick out of the serial log and paste into a spreadsheet. The sweep also records each step
+// in the FanController's fan curve, and saves the curve in EEPROM when it's done, so the product checks this
+// unit's fan against its own measurements. The currents in the curve are the clean-filter baseline for the
+// product's filter monitor, so do the sweep with a new filter installed. The curve has a point every 10%,
+// so SWEEP_STEP_PERCENT must be 10.
+const int SWEEP_STEP_PERCENT = 10;
+const unsigned long SWEEP_READING_MILLIS = 1000;  // must be at least the fanController's sensorThreshold
+const int SWEEP_STABLE_PERCENT = 1;               // the RPM is stable when it changes less than this between readings...
+const int SWEEP_STABLE_READINGS = 3;              // ...this many times in a row
+const unsigned long SWEEP_MAX_SETTLE_MILLIS = 30000; // if the RPM hasn't settled by now, measure anyway
+const int SWEEP_MEASURE_READINGS = 10;
+const int SWEEP_LEDS_ON = 2;                      // setup() leaves FAN_HIGH_LED_PIN and BATTERY_LED_LOW_PIN on
+
+// The sweep's state. These must be static, because the task function returns each time it waits.
+int sweepDutyCycle;
+int sweepReadingCount;
+unsigned int sweepRPM;
+unsigned int sweepPrevRPM;
+int sweepStableCount;
+unsigned long sweepSettleStartMillis;
+unsigned long sweepSettleMillis;
+unsigned int sweepMinRPM;
+unsigned int sweepMaxRPM;
+unsigned long sweepRPMSum;
+long long sweepMilliWattsSum;
+
+bool sweep(Task& task)
+{
+    TASK_BEGIN(task);
+    serialPrintf("sweep,dutyCycle,minRPM,avgRPM,maxRPM,milliWatts,settleMillis");
+
+    for (sweepDutyCycle = 0; sweepDutyCycle <= 100; sweepDutyCycle += SWEEP_STEP_PERCENT) {
+        setFanDutyCycle(sweepDutyCycle);
+
+        // Wait for the RPM to settle.
+        sweepSettleStartMillis = hw.millis();
+        sweepPrevRPM = 0;
+        sweepStableCount = 0;
+        while (sweepStableCount < SWEEP_STABLE_READINGS && hw.millis() - sweepSettleStartMillis < SWEEP_MAX_SETTLE_MILLIS) {
+            TASK_DELAY(task, SWEEP_READING_MILLIS);
+            sweepRPM = fanController.getRPM();
+            if (abs((long)sweepRPM - (long)sweepPrevRPM) * 100L < (long)sweepPrevRPM * SWEEP_STABLE_PERCENT) {
+                sweepStableCount += 1;
+            } else {
+                sweepStableCount = 0;
+            }
+            sweepPrevRPM = sweepRPM;
+        }
+        sweepSettleMillis = hw.millis() - sweepSettleStartMillis;
+
+        // Take the readings.
+        sweepMinRPM = UINT_MAX;
+        sweepMaxRPM = 0;
+        sweepRPMSum = 0;
+        sweepMilliWattsSum = 0;
+        for (sweepReadingCount = 0; sweepReadingCount < SWEEP_MEASURE_READINGS; sweepReadingCount += 1) {
+            TASK_DELAY(task, SWEEP_READING_MILLIS);
+            sweepRPM = fanController.getRPM();
+            sweepMinRPM = min(sweepMinRPM, sweepRPM);
+            sweepMaxRPM = max(sweepMaxRPM, sweepRPM);
+            sweepRPMSum += sweepRPM;
+            sweepMilliWattsSum += hw.readFanMilliWatts(SWEEP_LEDS_ON);
+        }
+
+        serialPrintf("sweep,%d,%u,%u,%u,%ld,%lu", sweepDutyCycle, sweepMinRPM, (unsigned int)(sweepRPMSum / SWEEP_MEASURE_READINGS),
+            sweepMaxRPM, (long)(sweepMilliWattsSum / SWEEP_MEASURE_READINGS), sweepSettleMillis);
+        fanController.setCurvePoint(sweepDutyCycle / SWEEP_STEP_PERCENT, sweepMinRPM, (unsigned int)(sweepRPMSum / SWEEP_MEASURE_READINGS), sweepMaxRPM,
+            (unsigned int)max(sweepMilliWattsSum / SWEEP_MEASURE_READINGS, 0LL));
+    }
+
+    fanController.saveCurve();
+    serialPrintf("sweep,done");
+    setFanDutyCycle(-10);
+    TASK_END(task);
 }
 
 class PowerOnButtonInterruptCallback : public InterruptCallback {
@@ -130,16 +277,33 @@ PowerOnButtonInterruptCallback powerOnButtonInterruptCallback;
 
 void setup()
 {
-    hw.setup();
+    config.load(); // the unit's own ADC scale factors, if it has them
+    hw.setup(false); // we only calibrate when the operator asks
     initializeSerial();
     fanController.begin();
+    fanController.dumpHealth(); // the unit's fan history, from when it was running the product firmware
     setFanDutyCycle(-10);
+    if (hw.digitalRead(FAN_DOWN_PIN) == BUTTON_PUSHED) {
+        calibrateCurrentZero();
+    } else if (hw.digitalRead(FAN_UP_PIN) == BUTTON_PUSHED) {
+        calibrateCurrentGain();
+    } else if (hw.digitalRead(POWER_OFF_PIN) == BUTTON_PUSHED) {
+        calibrateBandgap();
+    } else {
+        printCurrentCalibration("calibration");
+        serialPrintf("Bandgap: %u mV (0 = not calibrated, no AVCC correction)", hw.getBandgapMilliVolts());
+    }
+    // Restore the coulomb count the same way the product does, so the count that battery.update() saves
+    // in EEPROM is still good when the product firmware goes back on. We don't know where the battery has been.
+    battery.initializeCoulombCount(true);
+    if (hw.digitalRead(POWER_ON_PIN) == BUTTON_PUSHED) {
+        sweepTask.start();
+    }
     hw.digitalWrite(FAN_HIGH_LED_PIN, LED_ON);
     hw.digitalWrite(BATTERY_LED_LOW_PIN, LED_ON);
     hw.setPowerOnButtonInterruptCallback(&powerOnButtonInterruptCallback);
     //loopCount = 0;
     //startMillis = hw.millis();
-    battery.notifySystemActive(false);
 
     // test the long long datatype
     //#define LLONG_MAX 9223372036854775807LL
@@ -163,6 +327,14 @@ void loop()
     //    heartBeatToggle = !heartBeatToggle;
     //    hw.digitalWrite(CHARGING_LED_PIN, heartBeatToggle ? LED_ON : LED_OFF);
     //}
+    if (sweepTask.isActive()) {
+        // While the sweep is running, it has control of the fan, and it does its own reporting.
+        sweepTask.update();
+        fanController.getRPM();
+        battery.update();
+        return;
+    }
+
     offButton.update();
     onButton.update();
     downButton.update();
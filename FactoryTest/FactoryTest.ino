@@ -8,14 +8,12 @@
 #include "PAPRHwDefs.h"
 #include "libraries/ButtonDebounce/src/ButtonDebounce.h"
 #include "libraries/FanController/FanController.h"
+#include <stdarg.h>
 
 const int DELAY_100ms = 100;
 const int DELAY_200ms = 200;
 const int DELAY_300ms = 300;
 const int DELAY_500ms = 500;
-const int DELAY_1sec = 1000;
-const int DELAY_2sec = 2000;
-const int DELAY_3sec = 3000;
 
 // ----------------------- Button data -----------------------
 
@@ -26,8 +24,9 @@ ButtonDebounce buttonFanDown(FAN_DOWN_PIN, DELAY_100ms);
 // ----------------------- Fan data -----------------------
 
 // How many milliseconds should there be between readings of the fan speed. A smaller value will update
-// more often, while a higher value will give more accurate and smooth readings.
-const int FAN_SPEED_READING_INTERVAL = 1000;
+// more often, while a higher value will give more accurate and smooth readings. At full speed, half a second
+// is about 130 revolutions, which is plenty to tell whether the speed has settled.
+const int FAN_SPEED_READING_INTERVAL = 500;
 
 FanController fanController(FAN_RPM_PIN, FAN_SPEED_READING_INTERVAL, FAN_PWM_PIN);
 
@@ -44,6 +43,24 @@ const unsigned int MINIMUM_EXPECTED_FAN_SPEED = 3123;
 const unsigned int MEDIUM_EXPECTED_FAN_SPEED = 12033; 
 const unsigned int MAXIMUM_EXPECTED_FAN_SPEED = 15994;
 
+// The fan passes if its speed is within this many percent of the expected speed.
+const unsigned int FAN_SPEED_TOLERANCE_PERCENT = 20;
+
+// Instead of waiting a fixed time for the fan speed to stabilize, we take readings until the speed
+// stops changing. The speed has converged when it changes by less than FAN_CONVERGED_PERCENT, FAN_CONVERGED_READINGS
+// times in a row. If it hasn't converged after FAN_MAX_SETTLE_MILLIS, we check it anyway. We take our readings a
+// little less often than the fan controller updates its speed, so that each one is a new measurement.
+const unsigned int FAN_CONVERGED_PERCENT = 2;
+const int FAN_CONVERGED_READINGS = 2;
+const unsigned long FAN_CONVERGENCE_READING_MILLIS = FAN_SPEED_READING_INTERVAL + 100;
+const unsigned long FAN_MAX_SETTLE_MILLIS = 10000;
+
+// ----------------------- Battery data -----------------------
+
+// The battery voltage check passes if the reading is within the range that readBatteryFullness() expects.
+const uint16_t BATTERY_READING_MINIMUM = 386; // 12 volts
+const uint16_t BATTERY_READING_MAXIMUM = 784; // 24 volts
+
 // ----------------------- LED data -----------------------
 
 // A list of all the LEDs, from left to right as they appear on the board.
@@ -76,32 +93,6 @@ void flashLED(byte pin, unsigned long duration) {
     digitalWrite(pin, LED_OFF);
 }
 
-// Turn all the LEDs on, then off again.
-void flashLEDs(unsigned long duration) {
-    // Turn on all LEDs
-    for (int i = 0; i < numLEDs; i += 1) {
-        digitalWrite(LEDpins[i], LED_ON);
-    }
-
-    delay(duration);
-
-    // Turn off all LEDs
-    for (int i = 0; i < numLEDs; i += 1) {
-        digitalWrite(LEDpins[i], LED_OFF);
-    }
-
-    delay(duration);
-}
-
-// Flash all the LEDs a few times
-void exerciseAllLEDs() {
-    delay(DELAY_300ms);
-    for (int k = 0; k < 3; k += 1) {
-        flashLEDs(DELAY_300ms);
-    }
-    delay(DELAY_300ms);
-}
-
 // Flash all the LEDs, one at a time, starting with firstIndex, ending at lastIndex.
 void exerciseEachLED(int firstIndex, int lastIndex, int duration) {
     int increment = firstIndex < lastIndex ? 1 : -1;
@@ -138,150 +129,368 @@ void endExercise() {
 }
 
 /********************************************************************
- * Temporary debug code, because we don't yet have a usable serial port or debugger.
+ * Serial report
  ********************************************************************/
 
-void writeHexDigitToLights(int hexDigit) {
-    allLEDsOff();
+// The test results are written to the serial port as lines of comma-separated values, so a test station
+// can capture them and we can analyze them later. The serial port uses pins PD0 and PD1, which are also
+// the MODE_LED_3 and FAN_UP pins. So we only turn on the transmitter (not the receiver, which would take over
+// the LED), and only while we're writing the report. The Fan Up button doesn't work during that moment.
 
-    // Turn on the leftmost light, to show that we're displaying a number
-    digitalWrite(LEDpins[0], LED_ON);
+void beginReport() {
+    Serial.begin(57600);
+    UCSR0B = UCSR0B & ~(1 << RXCIE0); // disable RX Complete Interrupt Enable
+    UCSR0B = UCSR0B & ~(1 << RXEN0); // disable USART Receiver.
+}
 
-    // Turn on the lights corresponding to the bits of hexDigit
-    digitalWrite(LEDpins[3], (hexDigit & 8) ? LED_ON : LED_OFF);
-    digitalWrite(LEDpins[4], (hexDigit & 4) ? LED_ON : LED_OFF);
-    digitalWrite(LEDpins[5], (hexDigit & 2) ? LED_ON : LED_OFF);
-    digitalWrite(LEDpins[6], (hexDigit & 1) ? LED_ON : LED_OFF);
+void endReport() {
+    Serial.flush();
+    Serial.end();
+}
 
-    delay(DELAY_2sec);
-    allLEDsOff();
+void reportf(const char* format, ...) {
+    char buffer[80];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+    Serial.println(buffer);
 }
 
-// Write a 16-bit number to the LEDs, in hex. It looks like this ...
-//    all LEDs quickly flash, left to right
-//    high-order hex digit, in binary
-//    next hex digit, in binary
-//    next hex digit, in binary
-//    low-order hex digit, in binary
-//    all LEDs quickly flash, right to left
-void writeNumberToLights(uint16_t number) {
-    exerciseEachLED(0, numLEDs - 1, 50);
+/********************************************************************
+ * Test executive
+ *
+ * The checks are little state machines that we update from loop(), so several of them can run at
+ * the same time. The fan check doesn't need the LEDs or the buzzer, so it runs in the background while
+ * the tester watches the LEDs and listens to the buzzer. Nothing in the test calls delay(). Only the
+ * button-down LED exercise does, and it can't start while a test or its signals are running.
+ ********************************************************************/
 
-    writeHexDigitToLights((number >> 12) & 0xf);
-    delay(DELAY_1sec);
+const char* passFail(bool pass) {
+    return pass ? "PASS" : "FAIL";
+}
 
-    writeHexDigitToLights((number >> 8) & 0xf);
-    delay(DELAY_1sec);
+// ----------------------- Start and end signals -----------------------
 
-    writeHexDigitToLights((number >> 4) & 0xf);
-    delay(DELAY_1sec);
+// The same signals as startExercise() and endExercise(), one step per update: pairs of LEDs light up
+// from the middle outwards when a test starts, and from the outside inwards when it passes.
+const unsigned long SIGNAL_STEP_MILLIS = DELAY_100ms;
+const int SIGNAL_STEPS = 4;
 
-    writeHexDigitToLights((number) & 0xf);
-    delay(DELAY_1sec);
+int signalStep;
+bool signalEnding;
+unsigned long signalStepMillis;
+bool signalRunning;
 
-    exerciseEachLED(numLEDs - 1, 0, 50);
+void showSignalStep() {
+    const int i = signalEnding ? signalStep : SIGNAL_STEPS - 1 - signalStep;
+    allLEDsOff();
+    digitalWrite(LEDpins[i], LED_ON);
+    digitalWrite(LEDpins[6 - i], LED_ON);
 }
 
-/********************************************************************
- * Fan
- ********************************************************************/
+void startSignal(bool ending) {
+    signalEnding = ending;
+    signalStep = 0;
+    signalStepMillis = millis();
+    signalRunning = true;
+    showSignalStep();
+}
 
-void exerciseFan(byte dutyCycle, unsigned int expectedSpeed) {
-    // Set the fan speed
-    fanController.setDutyCycle(dutyCycle);
+void updateSignal() {
+    if (!signalRunning || millis() - signalStepMillis < SIGNAL_STEP_MILLIS) return;
 
-    // Wait a few seconds for the fan speed to stabilize
-    unsigned long startTime = millis();
-    while (millis() - startTime < DELAY_3sec) {
-        fanController.getSpeed(); // The fan controller speed function works better if we call it often.
+    signalStep += 1;
+    signalStepMillis = millis();
+    if (signalStep >= SIGNAL_STEPS) {
+        allLEDsOff();
+        signalRunning = false;
+        return;
     }
+    showSignalStep();
+}
 
-    // Check the fan speed
-    unsigned int speed = fanController.getSpeed();
-    fanController.setDutyCycle(FAN_DUTYCYCLE_MINIMUM); // we don't need the fan running any more
+// ----------------------- LED check -----------------------
 
-    // If the speed is too low or too high, show an error indication
-    if ((speed < (0.8 * expectedSpeed)) || (speed > (1.2 * expectedSpeed))) {
-        writeNumberToLights(speed);
-        exerciseAllLEDs();
-        exerciseAllLEDs();
-    }
+// Flash all the LEDs a few times. The tester verifies that they all light up.
+const unsigned long LED_CHECK_STEP_MILLIS = DELAY_300ms;
+const int LED_CHECK_STEPS = 8; // off, then three times on and off, then off
+
+int ledCheckStep;
+unsigned long ledCheckStepMillis;
+bool ledCheckRunning;
+
+void startLEDCheck() {
+    allLEDsOff();
+    ledCheckStep = 0;
+    ledCheckStepMillis = millis();
+    ledCheckRunning = true;
 }
 
-void exerciseFanMaximum() {
-    exerciseFan(FAN_DUTYCYCLE_MAXIMUM, MAXIMUM_EXPECTED_FAN_SPEED);
+void updateLEDCheck() {
+    if (!ledCheckRunning || millis() - ledCheckStepMillis < LED_CHECK_STEP_MILLIS) return;
+
+    ledCheckStep += 1;
+    ledCheckStepMillis = millis();
+    if (ledCheckStep >= LED_CHECK_STEPS) {
+        allLEDsOff();
+        ledCheckRunning = false;
+        return;
+    }
+    const bool on = (ledCheckStep % 2) == 1 && ledCheckStep < LED_CHECK_STEPS - 1;
+    for (int i = 0; i < numLEDs; i += 1) {
+        digitalWrite(LEDpins[i], on ? LED_ON : LED_OFF);
+    }
 }
 
-void exerciseFanMedium() {
-    exerciseFan(FAN_DUTYCYCLE_MEDIUM, MEDIUM_EXPECTED_FAN_SPEED);
+// ----------------------- Buzzer check -----------------------
+
+// Beep a few times. The tester verifies that they hear it.
+const unsigned long BUZZER_CHECK_ON_MILLIS = DELAY_500ms;
+const unsigned long BUZZER_CHECK_OFF_MILLIS = DELAY_200ms;
+const int BUZZER_CHECK_BEEPS = 5;
+
+int buzzerCheckBeeps;
+bool buzzerCheckOn;
+unsigned long buzzerCheckMillis;
+bool buzzerCheckRunning;
+
+void startBuzzerCheck() {
+    analogWrite(BUZZER_PIN, BUZZER_ON);
+    buzzerCheckOn = true;
+    buzzerCheckBeeps = 0;
+    buzzerCheckMillis = millis();
+    buzzerCheckRunning = true;
 }
 
-void exerciseFanMinimum() {
-    exerciseFan(FAN_DUTYCYCLE_MINIMUM, MINIMUM_EXPECTED_FAN_SPEED);
+void updateBuzzerCheck() {
+    if (!buzzerCheckRunning) return;
+
+    const unsigned long elapsed = millis() - buzzerCheckMillis;
+    if (buzzerCheckOn && elapsed >= BUZZER_CHECK_ON_MILLIS) {
+        analogWrite(BUZZER_PIN, BUZZER_OFF);
+        buzzerCheckOn = false;
+        buzzerCheckMillis = millis();
+    } else if (!buzzerCheckOn && elapsed >= BUZZER_CHECK_OFF_MILLIS) {
+        buzzerCheckBeeps += 1;
+        if (buzzerCheckBeeps >= BUZZER_CHECK_BEEPS) {
+            buzzerCheckRunning = false;
+        } else {
+            analogWrite(BUZZER_PIN, BUZZER_ON);
+            buzzerCheckOn = true;
+            buzzerCheckMillis = millis();
+        }
+    }
 }
 
-/********************************************************************
- * Other Devices
- ********************************************************************/
+// ----------------------- Fan check -----------------------
+
+// Run the fan at each of these duty cycles, and check that its speed is close to what we expect.
+// We go from fast to slow, so each step only has to slow the fan down a little.
+struct FanStep {
+    byte dutyCycle;
+    unsigned int expectedSpeed;
+};
+const FanStep fanSteps[] = {
+    { FAN_DUTYCYCLE_MAXIMUM, MAXIMUM_EXPECTED_FAN_SPEED },
+    { FAN_DUTYCYCLE_MEDIUM, MEDIUM_EXPECTED_FAN_SPEED },
+    { FAN_DUTYCYCLE_MINIMUM, MINIMUM_EXPECTED_FAN_SPEED }
+};
+const int numFanSteps = sizeof(fanSteps) / sizeof(FanStep);
+
+struct FanResult {
+    unsigned int speed;
+    unsigned long settleMillis;
+    bool converged;
+    bool pass;
+};
+FanResult fanResults[numFanSteps];
+
+int fanStepIndex;
+unsigned long fanStepStartMillis;
+unsigned long fanReadingMillis;
+unsigned int fanPreviousSpeed;
+int fanStableReadings;
+bool fanCheckRunning;
+
+void startFanStep(int index) {
+    fanStepIndex = index;
+    fanController.setDutyCycle(fanSteps[index].dutyCycle);
+    fanStepStartMillis = millis();
+    fanReadingMillis = fanStepStartMillis;
+    fanPreviousSpeed = 0;
+    fanStableReadings = 0;
+}
 
-void exerciseBuzzer() {
-    for (int i = 0; i < 5; i += 1) {
-        analogWrite(BUZZER_PIN, BUZZER_ON);
-        delay(DELAY_500ms);
+void startFanCheck() {
+    startFanStep(0);
+    fanCheckRunning = true;
+}
 
-        analogWrite(BUZZER_PIN, BUZZER_OFF);
-        delay(DELAY_200ms);
+void updateFanCheck() {
+    if (!fanCheckRunning || millis() - fanReadingMillis < FAN_CONVERGENCE_READING_MILLIS) return;
+    fanReadingMillis = millis();
+
+    // Has the speed stopped changing?
+    const unsigned int speed = fanController.getSpeed();
+    const unsigned int change = speed > fanPreviousSpeed ? speed - fanPreviousSpeed : fanPreviousSpeed - speed;
+    if ((unsigned long)change * 100 < (unsigned long)fanPreviousSpeed * FAN_CONVERGED_PERCENT) {
+        fanStableReadings += 1;
+    } else {
+        fanStableReadings = 0;
+    }
+    fanPreviousSpeed = speed;
+
+    const unsigned long settleMillis = millis() - fanStepStartMillis;
+    const bool converged = fanStableReadings >= FAN_CONVERGED_READINGS;
+    if (!converged && settleMillis < FAN_MAX_SETTLE_MILLIS) return;
+
+    // Check the speed.
+    const unsigned long expected = fanSteps[fanStepIndex].expectedSpeed;
+    FanResult& result = fanResults[fanStepIndex];
+    result.speed = speed;
+    result.settleMillis = settleMillis;
+    result.converged = converged;
+    result.pass = (speed * 100UL >= expected * (100 - FAN_SPEED_TOLERANCE_PERCENT)) &&
+                  (speed * 100UL <= expected * (100 + FAN_SPEED_TOLERANCE_PERCENT));
+
+    if (fanStepIndex + 1 < numFanSteps) {
+        startFanStep(fanStepIndex + 1);
+    } else {
+        fanController.setDutyCycle(FAN_DUTYCYCLE_MINIMUM); // we don't need the fan running any more
+        fanCheckRunning = false;
     }
 }
 
-void exerciseBatteryVoltage() {
-    // For the next 10 seconds we will display the battery voltage on the LEDs.
-    // Empty battery = 1 LEDs. Full battery = 7 LEDs.
-    // As you change the input voltage, the LEDs will update accordingly.
-    unsigned long startTime = millis();
-    while (millis() - startTime < 10000) {
-        unsigned int fullness = readBatteryFullness();
+// ----------------------- Battery voltage check -----------------------
+
+// For 10 seconds we display the battery voltage on the LEDs.
+// Empty battery = 1 LEDs. Full battery = 7 LEDs.
+// As you change the input voltage, the LEDs will update accordingly.
+// The reading at the start is checked, and goes in the report.
+const unsigned long BATTERY_CHECK_MILLIS = 10000;
+
+uint16_t batteryCheckReading;
+unsigned int batteryCheckFullness;
+unsigned long batteryCheckStartMillis;
+bool batteryCheckRunning;
+
+void startBatteryCheck() {
+    batteryCheckReading = analogRead(BATTERY_VOLTAGE_PIN);
+    batteryCheckFullness = readBatteryFullness();
+    batteryCheckStartMillis = millis();
+    batteryCheckRunning = true;
+}
 
-        // Calculate how many of the 7 LEDs we should show. 
-        uint16_t howManyLEDs = ((fullness * 6) / 100) + 1;
+void updateBatteryCheck() {
+    if (!batteryCheckRunning) return;
 
-        // Display the calculated number of LEDs.
+    if (millis() - batteryCheckStartMillis >= BATTERY_CHECK_MILLIS) {
         allLEDsOff();
-        for (int i = 0; i < howManyLEDs; i += 1) {
-            digitalWrite(LEDpins[i], LED_ON);
-        }
+        batteryCheckRunning = false;
+        return;
+    }
+
+    // Calculate how many of the 7 LEDs we should show. 
+    uint16_t howManyLEDs = ((readBatteryFullness() * 6) / 100) + 1;
+
+    // Display the calculated number of LEDs.
+    for (int i = 0; i < numLEDs; i += 1) {
+        digitalWrite(LEDpins[i], i < howManyLEDs ? LED_ON : LED_OFF);
     }
 }
 
+bool batteryCheckPassed() {
+    return batteryCheckReading >= BATTERY_READING_MINIMUM && batteryCheckReading <= BATTERY_READING_MAXIMUM;
+}
+
 /********************************************************************
- * Main program that drives the sequence of exercises.
+ * Main program that drives the test.
  ********************************************************************/
 
-void (*exercises[])() = {
-        exerciseAllLEDs,
-        exerciseBuzzer,
-        exerciseFanMaximum,
-        exerciseFanMedium,
-        exerciseFanMinimum,
-        exerciseBatteryVoltage
-};
-const int numberOfExercises = sizeof(exercises) / sizeof(void (*)());
+// How many times the test has run since reset. It's in the report, so we can tell runs apart.
+int testRunNumber;
+unsigned long testStartMillis;
+bool testRunning;
+bool checksStarted;
+
+// Show the start signal. The checks start when it's done.
+void startTest() {
+    testRunNumber += 1;
+    testRunning = true;
+    checksStarted = false;
+    startSignal(false);
+}
+
+// Start all the checks. The LED check and the buzzer check run at the same time, and the fan check runs
+// in the background. The battery voltage check needs the LEDs, so it starts when the LED check is done.
+void startChecks() {
+    checksStarted = true;
+    testStartMillis = millis();
+    startFanCheck();
+    startLEDCheck();
+    startBuzzerCheck();
+    batteryCheckRunning = false;
+    batteryCheckReading = 0;
+}
 
-int currentExercise;
+// Write the report, and show the overall result: if anything failed, the Error LED stays on. Otherwise
+// we show the end signal, which loop() carries on with after the test is over.
+void finishTest() {
+    testRunning = false;
 
-// Do the next exercise. If we've done them all, then start over at the first.
-void doNextExercise() {
-    currentExercise = (currentExercise + 1) % numberOfExercises;
+    bool pass = batteryCheckPassed();
+    for (int i = 0; i < numFanSteps; i += 1) {
+        pass = pass && fanResults[i].pass;
+    }
+
+    beginReport();
+    reportf("test,begin,%d", testRunNumber);
+    reportf("check,dutyCycle,expectedRPM,RPM,settleMillis,converged,result");
+    for (int i = 0; i < numFanSteps; i += 1) {
+        const FanResult& result = fanResults[i];
+        reportf("fan,%d,%u,%u,%lu,%d,%s", fanSteps[i].dutyCycle, fanSteps[i].expectedSpeed,
+            result.speed, result.settleMillis, result.converged, passFail(result.pass));
+    }
+    reportf("check,reading,percentFull,result");
+    reportf("battery,%u,%u,%s", batteryCheckReading, batteryCheckFullness, passFail(batteryCheckPassed()));
+    reportf("test,end,%d,%lu,%s", testRunNumber, millis() - testStartMillis, passFail(pass));
+    endReport();
+
+    if (pass) {
+        startSignal(true);
+    } else {
+        digitalWrite(Error_LED_PIN, LED_ON);
+    }
+}
 
-    startExercise();
-    (*exercises[currentExercise])();
-    endExercise();
+void updateTest() {
+    if (!testRunning) return;
+    if (!checksStarted) {
+        if (signalRunning) return;
+        startChecks();
+    }
+
+    updateFanCheck();
+    updateBuzzerCheck();
+    if (ledCheckRunning) {
+        updateLEDCheck();
+        if (!ledCheckRunning) {
+            startBatteryCheck();
+        }
+    } else {
+        updateBatteryCheck();
+    }
+
+    if (!fanCheckRunning && !buzzerCheckRunning && !ledCheckRunning && !batteryCheckRunning) {
+        finishTest();
+    }
 }
 
 // Handler for Fan Button Down
 // This button runs the fan-button-down exercise.
 void onButtonDownChange(const int state) {
-    if (state == BUTTON_RELEASED) {
+    if (state == BUTTON_RELEASED && !testRunning && !signalRunning) {
         startExercise();
         exerciseEachLED(0, numLEDs - 1, DELAY_500ms);
         endExercise();
@@ -289,11 +498,10 @@ void onButtonDownChange(const int state) {
 }
 
 // Handler for Fan Button Up
-// This button advances to the next exercise.
+// This button runs the test again.
 void onButtonUpChange(const int state) {
-    if (state == BUTTON_RELEASED) {
-        // advance to the next exercise
-        doNextExercise();
+    if (state == BUTTON_RELEASED && !testRunning && !signalRunning) {
+        startTest();
     }
 }
 
@@ -325,9 +533,9 @@ void setup() {
     // Set fan to default speed
     fanController.setDutyCycle(FAN_DUTYCYCLE_MINIMUM);
 
-    // Do our startup exercise
-    currentExercise = -1;
-    doNextExercise();
+    // Start the test
+    testRunNumber = 0;
+    startTest();
 }
 
 void loop() {
@@ -336,6 +544,8 @@ void loop() {
     buttonFanUp.update();
     buttonFanDown.update();
     fanController.getSpeed(); // The fan controller speed function works better if we call it often.
+    updateSignal();
+    updateTest();
     
     if (digitalRead(Monitor_PIN) == LOW) {
         onMonitorActive();
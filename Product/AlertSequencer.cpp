@@ -0,0 +1,118 @@
+/*
+ * AlertSequencer.cpp
+ */
+#include "AlertSequencer.h"
+
+AlertSequencer* AlertSequencer::instance;
+
+AlertSequencer::AlertSequencer(void (*setLED)(int pin, int onOff), void (*setBuzzer)(unsigned int frequencyHz, int dutyCyclePercent)) :
+    setLED(setLED),
+    setBuzzer(setBuzzer),
+    current(0),
+    stepTimer([]() { instance->onStepTimer(); })
+{
+    for (int i = 0; i < numAlertPriorities; i += 1) {
+        requested[i] = 0;
+    }
+    pattern.ledsUsed = 0;
+    instance = this;
+}
+
+void AlertSequencer::play(const AlertPattern* newPattern)
+{
+    const byte priority = pgm_read_byte(&newPattern->priority);
+    if (requested[priority] != newPattern) {
+        requested[priority] = newPattern;
+        chooseCurrentPattern();
+    }
+}
+
+void AlertSequencer::stop(const AlertPattern* oldPattern)
+{
+    const byte priority = pgm_read_byte(&oldPattern->priority);
+    if (requested[priority] == oldPattern) {
+        requested[priority] = 0;
+        chooseCurrentPattern();
+    }
+}
+
+void AlertSequencer::stopAll()
+{
+    for (int i = 0; i < numAlertPriorities; i += 1) {
+        requested[i] = 0;
+    }
+    chooseCurrentPattern();
+}
+
+bool AlertSequencer::ownsLED(int pin)
+{
+    for (int i = 0; i < numLEDs; i += 1) {
+        if (LEDpins[i] == pin) {
+            return (pattern.ledsUsed & (1 << i)) != 0;
+        }
+    }
+    return false;
+}
+
+// Make sure that the pattern being played is the highest priority one that has been requested.
+void AlertSequencer::chooseCurrentPattern()
+{
+    const AlertPattern* highest = 0;
+    for (int i = numAlertPriorities - 1; i >= 0 && !highest; i -= 1) {
+        highest = requested[i];
+    }
+    if (highest == current) {
+        return;
+    }
+
+    // Silence the pattern that was playing, and give its LEDs back to their owners.
+    if (current) {
+        for (int i = 0; i < numLEDs; i += 1) {
+            if (pattern.ledsUsed & (1 << i)) {
+                setLED(LEDpins[i], LED_OFF);
+            }
+        }
+        setBuzzer(0, 0);
+    }
+
+    current = highest;
+    if (current) {
+        memcpy_P(&pattern, current, sizeof(AlertPattern));
+        stepIndex = 0;
+        repeatsRemaining = pattern.repeatCount;
+        showStep();
+    } else {
+        pattern.ledsUsed = 0;
+        stepTimer.cancel();
+    }
+}
+
+// Set the LEDs and buzzer as described by the current step, and start timing the step.
+void AlertSequencer::showStep()
+{
+    AlertStep step;
+    memcpy_P(&step, &pattern.steps[stepIndex], sizeof(AlertStep));
+    for (int i = 0; i < numLEDs; i += 1) {
+        if (pattern.ledsUsed & (1 << i)) {
+            setLED(LEDpins[i], (step.leds & (1 << i)) ? LED_ON : LED_OFF);
+        }
+    }
+    setBuzzer(step.buzzerHz, step.buzzerDuty);
+    stepTimer.start(step.millis);
+}
+
+// This is the callback function for stepTimer. It advances to the next step, or to the
+// next repetition, or finishes the pattern.
+void AlertSequencer::onStepTimer()
+{
+    stepIndex += 1;
+    if (stepIndex >= pattern.stepCount) {
+        stepIndex = 0;
+        if (pattern.repeatCount && --repeatsRemaining == 0) {
+            requested[pattern.priority] = 0;
+            chooseCurrentPattern();
+            return;
+        }
+    }
+    showStep();
+}
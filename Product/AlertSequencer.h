@@ -0,0 +1,79 @@
+/*
+ * AlertSequencer.h
+ *
+ * The AlertSequencer plays "alert patterns" on the LEDs and the buzzer. A pattern is a little script
+ * that lives in program memory (PROGMEM), so adding a new kind of alert costs no RAM. Each step of the
+ * script says which LEDs are on, what the buzzer is doing, and how long the step lasts.
+ *
+ * Several patterns can be requested at the same time, but only one of them plays at any moment:
+ * the one with the highest priority. When it finishes or is stopped, the next highest one starts
+ * playing from its beginning. All the timing is done with a single Timer, so there are no busy loops.
+ */
+#pragma once
+#include "Hardware.h"
+#include "Timer.h"
+#ifndef UNITTEST
+#include <avr/pgmspace.h>
+#endif
+
+// One step of an alert pattern.
+struct AlertStep {
+    byte leds;             // which LEDs are on during this step. Bit i corresponds to LEDpins[i].
+    unsigned int buzzerHz; // the buzzer frequency, or 0 if the buzzer is silent during this step
+    byte buzzerDuty;       // the buzzer duty cycle, in percent
+    unsigned int millis;   // how long the step lasts. Must be at least 1.
+};
+
+// The priority of a pattern. If several patterns are requested at the same time, the one
+// with the highest priority is played. There can be at most one requested pattern per priority.
+enum AlertPriority { priorityFilterReminder, priorityReminder, priorityBatteryAlert, priorityFanAlert, priorityPowerOffWarning, priorityResetFlash, numAlertPriorities };
+
+// A complete alert pattern. Patterns and their steps must be declared PROGMEM.
+struct AlertPattern {
+    byte priority;          // an AlertPriority
+    byte ledsUsed;          // the LEDs that this pattern controls. The pattern doesn't touch any other LEDs.
+    byte repeatCount;       // how many times to play the steps, or 0 to repeat until the pattern is stopped
+    byte stepCount;         // how many steps there are
+    const AlertStep* steps; // the steps
+};
+
+class AlertSequencer {
+public:
+    // The sequencer writes to the LEDs and buzzer using these functions. A buzzer frequency of 0 means silence.
+    AlertSequencer(void (*setLED)(int pin, int onOff), void (*setBuzzer)(unsigned int frequencyHz, int dutyCyclePercent));
+
+    // Request a pattern. It starts playing right away, unless a higher priority pattern is playing.
+    // If the pattern has already been requested, this does nothing.
+    void play(const AlertPattern* pattern);
+
+    // Withdraw a request for a pattern. If it was playing, its LEDs and the buzzer are turned off.
+    void stop(const AlertPattern* pattern);
+
+    // Withdraw all requests.
+    void stopAll();
+
+    // Is this pattern the one that's playing right now?
+    bool isPlaying(const AlertPattern* pattern) { return current == pattern; }
+
+    // Is the pattern that's playing right now controlling this LED? If so, nobody else should touch it.
+    bool ownsLED(int pin);
+
+    // Call this from loop().
+    void update() { stepTimer.update(); }
+
+private:
+    void chooseCurrentPattern();
+    void showStep();
+    void onStepTimer();
+
+    void (*setLED)(int pin, int onOff);
+    void (*setBuzzer)(unsigned int frequencyHz, int dutyCyclePercent);
+    const AlertPattern* requested[numAlertPriorities]; // the requested patterns, indexed by priority
+    const AlertPattern* current; // the pattern that's playing right now, or null
+    AlertPattern pattern;        // a RAM copy of *current
+    byte stepIndex;              // which step of the current pattern is showing
+    byte repeatsRemaining;       // how many more times we will play the current pattern's steps
+    Timer stepTimer;             // goes off when it's time for the next step
+
+    static AlertSequencer* instance;
+};
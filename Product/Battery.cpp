@@ -1,6 +1,10 @@
 #include "Battery.h"
 #include "Hardware.h"
 #include "MySerial.h"
+#include "Config.h"
+#ifndef UNITTEST
+#include <avr/pgmspace.h>
+#endif
 
 #define hw Hardware::instance
 
@@ -42,35 +46,162 @@
 
 // Some parameters used by the coulomb counting algorithm.
 const int BATTERY_VOLTAGE_UPDATE_INTERVAL_MILLISECS = 500;
-const unsigned long CHARGER_WINDDOWN_TIME_MILLIS = 1UL * 60UL * 1000UL; // 1 minute in milliseconds
-const long long CHARGE_MICRO_AMPS_WHEN_FULL = 200000LL; // 0.2 Amps
-const long long BATTERY_MICRO_VOLTS_CHANGED_THRESHOLD = 100000LL; // 0.1 volts
+
+// Parameters used to track the phases of charging (see updateChargePhase). We average the charge current over
+// 10-second windows. The charger has moved from constant current to constant voltage when, for 2 windows in a row,
+// the current is below 80% of its highest average (or below 1.5 amps) and the voltage is up near the charger's
+// constant voltage. We don't look for constant voltage until we've been charging for a minute, like the old
+// winddown time, so the slow rise in current when the charger starts up doesn't look like the taper.
+//
+// The battery is full when the current is positive and not rising, the voltage is still up near the constant
+// voltage and hasn't moved more than 0.1 volts, and the current will be below config.chargeMicroAmpsWhenFull
+// (0.2 amps by default) by the end of the next window. We project the current forward using the slope of the
+// taper, so we usually recognize the full battery at about the moment the current crosses the threshold,
+// instead of a few seconds after it. The window average is much less noisy than a single reading, so one window
+// is enough. All this keeps a weak charger, which can't keep up with the fan and so never pushes the voltage up,
+// from looking like a full battery.
+//
+// A full battery measures FULL_MICRO_VOLTS (see voltageTable). The voltage reading can be off by
+// VOLTAGE_TOLERANCE_PERCENT (see the note in Hardware.h), so a unit that reads low must still count as being
+// near the constant voltage.
+const unsigned long CHARGE_WINDOW_MILLIS = 10000UL;
+const long CONSTANT_CURRENT_MIN_MICRO_AMPS = 1500000L;
+const long CONSTANT_VOLTAGE_PERCENT_OF_PEAK = 80L;
+const long long FULL_MICRO_VOLTS = 25050000LL;
+const long long VOLTAGE_TOLERANCE_PERCENT = 4LL;
+const long long CONSTANT_VOLTAGE_MIN_MICRO_VOLTS = FULL_MICRO_VOLTS / 100LL * (100LL - VOLTAGE_TOLERANCE_PERCENT);
+const long long STABLE_MICRO_VOLTS = 100000LL;
+const unsigned long MIN_CONSTANT_CURRENT_MILLIS = 60000UL;
+const int CONSTANT_VOLTAGE_CONFIRMATION_WINDOWS = 2;
+const long TAPER_AVERAGE_DIVISOR = 4L;
+
+// Below this current, we ask Hardware for precise current sampling rather than fast sampling. The extra resolution
+// matters most at low currents, such as near the end of charging, while the fast sampling
+// keeps up better with changes at high currents.
+const long long PRECISE_SAMPLING_MICRO_AMPS = 500000LL;
+
+// We save the coulomb count in EEPROM whenever it changes by 1% of the battery capacity, but not more than
+// once a minute. A full discharge and recharge therefore causes roughly 200 saves. The journal spreads
+// these across 19 slots, so each EEPROM byte would last for thousands of charge cycles.
+const long long SAVE_CHANGE_DIVISOR = 100LL;
+const unsigned long SAVE_MIN_INTERVAL_MILLIS = 60UL * 1000UL; // 1 minute
+
+// If the battery may have been disconnected, we only trust the saved coulomb count if it is within this
+// amount of the estimate from the battery voltage. Otherwise we assume that this is a different battery,
+// or that it was charged by some other means.
+const long long SAVED_CHARGE_TOLERANCE_DIVISOR = 5LL;
+
+// The capacity of a real battery pack is different from the nominal capacity, and it goes down as the pack ages.
+// So we learn the capacity of the pack: each time the battery goes from a full charge down to a known low voltage,
+// the amount of charge that came out, plus the charge that's known to remain at that low voltage, is a
+// measurement of the capacity. The discharge measurements show about 2,100 coulombs remaining
+// (config.batteryMinChargePicoCoulombs) at 16.6 volts.
+const long long LOW_VOLTAGE_POINT_MICRO_VOLTS = 16600000LL;
+
+// To keep one bad measurement from doing much harm, each measurement only moves the learned capacity
+// 1/4 of the way, and the learned capacity always stays between 50% and 110% of the nominal capacity.
+const long long CAPACITY_LEARNING_DIVISOR = 4LL;
+const long long MIN_LEARNED_CAPACITY_PERCENT = 50LL;
+const long long MAX_LEARNED_CAPACITY_PERCENT = 110LL;
+
+static long long constrainCapacity(long long picoCoulombs) {
+    const long long onePercent = config.batteryCapacityPicoCoulombs / 100LL;
+    return constrain(picoCoulombs, onePercent * MIN_LEARNED_CAPACITY_PERCENT, onePercent * MAX_LEARNED_CAPACITY_PERCENT);
+}
+
+// The runtime estimate is updated once a second. Each update moves the average discharge current 1/64 of the way
+// towards the latest reading, so the average follows changes in load with a time constant of about a minute.
+const unsigned long RUNTIME_UPDATE_INTERVAL_MILLIS = 1000UL;
+const long DISCHARGE_AVERAGE_DIVISOR = 64L;
+const long long PICO_COULOMBS_PER_MICRO_AMP_MINUTE = 60000000LL;
+
+// Until the battery has been fully charged, the coulomb count is only as good as the initial estimate
+// from the voltage. So while the count is uncalibrated, we correct it once a second using the voltage,
+// with a one-dimensional Kalman filter. The filter weighs the count against the voltage estimate according
+// to how uncertain each one is. The count starts out very uncertain, so the first few corrections are large,
+// and then the count quickly becomes more trustworthy than any single voltage reading. The minimum variance
+// keeps the filter from ever ignoring the voltage completely: at the minimum, each correction moves the
+// count about 0.2% of the way towards the voltage estimate, so any remaining error decays over ten minutes or so.
+// Counting adds uncertainty of its own, because the current sensor isn't perfect: each coulomb that flows adds
+// CHARGE_VARIANCE_PER_COULOMB to the variance. With the corrections pulling the other way, the uncertainty
+// settles at about 90 coulombs (0.4%) during a long discharge at a typical load.
+// The voltage we read under load is lower than the rest voltage that voltageTable is based on, so we add
+// back the drop across the battery's internal resistance first. We don't correct while the fan is changing
+// speed, because then the smoothed voltage and current don't match.
+// The variances are in coulombs squared, so they fit in a long. The correction itself is in milliCoulombs,
+// so that the small corrections near the minimum variance don't round away to nothing.
+const bool VOLTAGE_CORRECTION_ENABLED = true;
+const long INITIAL_CHARGE_VARIANCE = 5000L * 5000L;    // about 20% of the nominal capacity
+const long VOLTAGE_ESTIMATE_VARIANCE = 2500L * 2500L;  // about 10% of the nominal capacity
+const long MIN_CHARGE_VARIANCE = 100L * 100L;
+const long CHARGE_VARIANCE_PER_COULOMB = 10L;
+const long long PICO_COULOMBS_PER_COULOMB = 1000000000000LL;
+const long long PICO_COULOMBS_PER_MILLI_COULOMB = 1000000000LL;
 
 // Whenever we wake up from sleeping, we have to re-inititialize all the data used for coulomb counting.
-// We don't coulomb count when the system is sleeping, because the amount of current flow is 
-// negligible during sleep, and because you can't run code when you're sleeping!
-void Battery::wakeUp() {
-    lastCoulombsUpdateMicroSecs = hw.micros();
+// We don't coulomb count when the system is sleeping, because you can't run code when you're sleeping!
+// The current during sleep is tiny, but a unit can sleep for months, so we take away
+// config.batterySleepMicroAmps for the whole time we slept.
+void Battery::wakeUp(unsigned long sleptMillis) {
+    picoCoulombs -= config.batterySleepMicroAmps * sleptMillis * 1000LL;
+    dischargedPicoCoulombs += config.batterySleepMicroAmps * sleptMillis * 1000LL;
+    picoCoulombs = constrain(picoCoulombs, 0, capacityPicoCoulombs);
+
+    hw.takePicoCoulombs(); // throw away anything that was counted before we slept
     microVolts = 20000000LL;
-    chargeStartMilliSecs = hw.millis();
-    lastVoltageChangeMilliSecs = hw.millis();
-    prevIsCharging = false;
-    prevMicroVolts = 0;
-    maybeChargingFinished = false;
+    microAmps = 0;
+    lastRuntimeUpdateMilliSecs = hw.millis();
+    chargePhase = chargePhaseNotCharging;
+    minutesToFull = -1;
 }
 
-// Given a battery voltage, estimate how much charge is in the battery. This little ad-hoc
-// formula is based on measurements I made of a "typical" battery. You can see the raw data in
-// the "Time vs. Battery/Charger Voltage" and "Time vs. Battery Charge" charts of the document at
+// The charge in a "typical" battery at various voltages. Between points we interpolate linearly, and outside
+// the table we use the first or last point. The points come from the measurements in the "Time vs.
+// Battery/Charger Voltage" and "Time vs. Battery Charge" charts of the document at
 // https://docs.google.com/spreadsheets/d/14-mchRN22HC6OSyAcN329NEcRRjF2_VMbKz3yHDDEoI
-long long Battery::estimatePicoCoulombsFromVoltage(long long microVolts) {    
+// So far we only have enough data for a few points. To add a point from a new discharge curve, let the battery rest, note its voltage, then count the coulombs
+// that come out until the battery is empty. The points must be in order of increasing voltage.
+struct VoltagePoint {
+    unsigned int milliVolts;
+    unsigned int coulombs;
+};
+const VoltagePoint voltageTable[] PROGMEM = {
+    { 14500,     0 },
+    { 16500,  2000 },
+    { 20000,  5000 },
+    { 25050, 25200 },
+};
+const int numVoltagePoints = sizeof(voltageTable) / sizeof(voltageTable[0]);
+
+// Given a battery voltage, estimate how much charge is in the battery, using voltageTable.
+long long Battery::estimatePicoCoulombsFromVoltage(long long microVolts) {
     const long milliVolts = ((long)microVolts) / 1000L;
-    long coulombs;
+    VoltagePoint low, high;
+
+    // Find the first point above the voltage, using a binary search.
+    int lowIndex = 0;
+    int highIndex = numVoltagePoints;
+    while (lowIndex < highIndex) {
+        const int middleIndex = (lowIndex + highIndex) / 2;
+        if ((long)pgm_read_word(&voltageTable[middleIndex].milliVolts) <= milliVolts) {
+            lowIndex = middleIndex + 1;
+        } else {
+            highIndex = middleIndex;
+        }
+    }
 
-    if (milliVolts >= 20000L) {
-        coulombs = 5000L + ((milliVolts - 20000L) * 4);
+    long coulombs;
+    if (highIndex == 0) {
+        memcpy_P(&low, &voltageTable[0], sizeof(VoltagePoint));
+        coulombs = low.coulombs;
+    } else if (highIndex == numVoltagePoints) {
+        memcpy_P(&high, &voltageTable[numVoltagePoints - 1], sizeof(VoltagePoint));
+        coulombs = high.coulombs;
     } else {
-        coulombs = 2000L + (milliVolts - 16500L);
+        memcpy_P(&low, &voltageTable[highIndex - 1], sizeof(VoltagePoint));
+        memcpy_P(&high, &voltageTable[highIndex], sizeof(VoltagePoint));
+        coulombs = (long)low.coulombs + ((milliVolts - (long)low.milliVolts) * ((long)high.coulombs - (long)low.coulombs)) /
+            ((long)high.milliVolts - (long)low.milliVolts);
     }
 
     return ((long long)coulombs) * 1000000000000LL;
@@ -78,13 +209,146 @@ long long Battery::estimatePicoCoulombsFromVoltage(long long microVolts) {
 
 // Function to initialize the coulomb counter. We can't do this in the Battery constructor,
 // because the constructor runs before the hardware is fully initialized.
-void Battery::initializeCoulombCount() {
-    picoCoulombs = constrain(estimatePicoCoulombsFromVoltage(hw.readMicroVolts()), 0, BATTERY_CAPACITY_PICO_COULOMBS);
+void Battery::initializeCoulombCount(bool batteryMayHaveChanged) {
+    const long long nominalPicoCoulombs = config.batteryCapacityPicoCoulombs;
+    capacityPicoCoulombs = nominalPicoCoulombs;
+    saveChangePicoCoulombs = nominalPicoCoulombs / SAVE_CHANGE_DIVISOR;
+    long long savedCapacity;
+    if (capacityJournal.read(&savedCapacity)) {
+        capacityPicoCoulombs = constrainCapacity(savedCapacity);
+    }
+
+    // Use the voltage from before the fan started, because the fan's load pulls the voltage down.
+    const long long estimate = constrain(estimatePicoCoulombsFromVoltage(hw.readRestMicroVolts()), 0, capacityPicoCoulombs);
+    SavedCharge saved;
+    if (savedChargeJournal.read(&saved) &&
+        (!batteryMayHaveChanged || abs(saved.picoCoulombs - estimate) < nominalPicoCoulombs / SAVED_CHARGE_TOLERANCE_DIVISOR))
+    {
+        picoCoulombs = constrain(saved.picoCoulombs, 0, capacityPicoCoulombs);
+        chargeIsCalibrated = saved.calibrated;
+        serialPrintf("Restored charge %s, %s", renderLongLong(picoCoulombs), chargeIsCalibrated ? "calibrated" : "estimated");
+        chargeVariance = MIN_CHARGE_VARIANCE;
+    } else {
+        picoCoulombs = estimate;
+        chargeIsCalibrated = false;
+        chargeVariance = INITIAL_CHARGE_VARIANCE;
+    }
+    countedPicoCoulombs = 0;
+    savedPicoCoulombs = picoCoulombs;
+    lastSaveMilliSecs = hw.millis();
 }
 
-Battery::Battery()
+void Battery::resumeCoulombCount(long long savedPicoCoulombs, bool calibrated) {
+    picoCoulombs = constrain(savedPicoCoulombs, 0, capacityPicoCoulombs);
+    chargeIsCalibrated = calibrated;
+    chargeVariance = MIN_CHARGE_VARIANCE;
+    countedPicoCoulombs = 0;
+}
+
+// Update the time remaining until the battery is empty. This assumes that the current load continues.
+void Battery::updateRuntimeEstimate(long long chargeFlowMicroAmps) {
+    if (isCharging()) {
+        minutesRemaining = -1;
+        return;
+    }
+
+    // Update the average discharge current for the current fan speed. The first reading for each speed
+    // becomes the starting value of the average. While the fan is changing speed we keep using the average
+    // we have, because the current during the ramp belongs to neither speed.
+    long& average = dischargeMicroAmps[fanSpeed];
+    const long reading = (long)-chargeFlowMicroAmps;
+    if (fanSettling) {
+        // leave the average alone
+    } else if (average == 0) {
+        average = reading;
+    } else {
+        average += (reading - average) / DISCHARGE_AVERAGE_DIVISOR;
+    }
+
+    if (average <= 0) {
+        minutesRemaining = -1;
+        return;
+    }
+    const long long usablePicoCoulombs = max(picoCoulombs - config.batteryMinChargePicoCoulombs, 0LL);
+    minutesRemaining = (int)(usablePicoCoulombs / average / PICO_COULOMBS_PER_MICRO_AMP_MINUTE);
+}
+
+long long Battery::getRestMicroVolts() {
+    // microAmps is negative while discharging, so this adds the voltage drop across the internal resistance.
+    return microVolts - microAmps * BATTERY_RESISTANCE_MILLI_OHMS / 1000LL;
+}
+
+// One step of the Kalman filter. The coulomb count is the prediction, and the voltage estimate is the measurement.
+void Battery::correctFromVoltage() {
+    // The counting since the last step made the count less certain.
+    chargeVariance = min(chargeVariance + (long)(countedPicoCoulombs / PICO_COULOMBS_PER_COULOMB) * CHARGE_VARIANCE_PER_COULOMB,
+        INITIAL_CHARGE_VARIANCE);
+    countedPicoCoulombs = 0;
+
+    const long long measuredPicoCoulombs = constrain(estimatePicoCoulombsFromVoltage(getRestMicroVolts()), 0, capacityPicoCoulombs);
+    const long long errorMilliCoulombs = (measuredPicoCoulombs - picoCoulombs) / PICO_COULOMBS_PER_MILLI_COULOMB;
+
+    // The Kalman gain is chargeVariance / (chargeVariance + VOLTAGE_ESTIMATE_VARIANCE).
+    const long long totalVariance = (long long)chargeVariance + VOLTAGE_ESTIMATE_VARIANCE;
+    const long long correctionMilliCoulombs = errorMilliCoulombs * chargeVariance / totalVariance;
+    picoCoulombs += correctionMilliCoulombs * PICO_COULOMBS_PER_MILLI_COULOMB;
+    picoCoulombs = constrain(picoCoulombs, 0, capacityPicoCoulombs);
+
+    // Combining the two estimates makes the count less uncertain.
+    chargeVariance = max((long)((long long)chargeVariance * VOLTAGE_ESTIMATE_VARIANCE / totalVariance), MIN_CHARGE_VARIANCE);
+}
+
+void Battery::learnCapacity(long long measuredPicoCoulombs) {
+    measuredPicoCoulombs = constrainCapacity(measuredPicoCoulombs);
+    capacityPicoCoulombs += (measuredPicoCoulombs - capacityPicoCoulombs) / CAPACITY_LEARNING_DIVISOR;
+    capacityJournal.write(&capacityPicoCoulombs);
+    serialPrintf("Measured capacity %s, learned capacity %s", renderLongLong(measuredPicoCoulombs), renderLongLong(capacityPicoCoulombs));
+}
+
+void Battery::saveCoulombCount() {
+    if (picoCoulombs != savedPicoCoulombs) {
+        SavedCharge saved = { picoCoulombs, chargeIsCalibrated };
+        savedChargeJournal.write(&saved);
+        savedPicoCoulombs = picoCoulombs;
+    }
+    lastSaveMilliSecs = hw.millis();
+}
+
+void Battery::maybeSaveCoulombCount() {
+    if ((abs(picoCoulombs - savedPicoCoulombs) >= saveChangePicoCoulombs) &&
+        (hw.millis() - lastSaveMilliSecs > SAVE_MIN_INTERVAL_MILLIS))
+    {
+        saveCoulombCount();
+    }
+}
+
+void Battery::takeChargeFlow(long long* inPicoCoulombs, long long* outPicoCoulombs) {
+    *inPicoCoulombs = chargedPicoCoulombs;
+    *outPicoCoulombs = dischargedPicoCoulombs;
+    chargedPicoCoulombs = 0;
+    dischargedPicoCoulombs = 0;
+}
+
+Battery::Battery() :
+    capacityJournal(EEPROM_BATTERY_CAPACITY_ADDRESS, EEPROM_BATTERY_CAPACITY_SIZE, sizeof(long long)),
+    savedChargeJournal(EEPROM_BATTERY_JOURNAL_ADDRESS, EEPROM_BATTERY_JOURNAL_SIZE, sizeof(SavedCharge))
 {
-    wakeUp();
+    picoCoulombs = 0;
+    // initializeCoulombCount() replaces these with the configured values. The constructor may run before Config's.
+    capacityPicoCoulombs = BATTERY_CAPACITY_PICO_COULOMBS;
+    saveChangePicoCoulombs = BATTERY_CAPACITY_PICO_COULOMBS / SAVE_CHANGE_DIVISOR;
+    for (int i = 0; i < BATTERY_NUM_FAN_SPEEDS; i += 1) {
+        dischargeMicroAmps[i] = 0;
+    }
+    fanSpeed = 0;
+    fanSettling = false;
+    minutesRemaining = -1;
+    chargeIsCalibrated = false;
+    chargeVariance = INITIAL_CHARGE_VARIANCE;
+    chargedPicoCoulombs = 0;
+    dischargedPicoCoulombs = 0;
+    countedPicoCoulombs = 0;
+    wakeUp(0);
 }
 
 // The Charger Connected pin indicates whether the charger is connected. It DOES NOT tell you if the 
@@ -95,30 +359,119 @@ bool Battery::isCharging()
     return hw.digitalRead(CHARGER_CONNECTED_PIN) == CHARGER_CONNECTED;
 }
 
-// The coloumb counting algorithm (in Battery::update()) needs to know how long ago the voltage changed,
-// and how long ago the battery started charging. This function keeps track of that information in
-// the variables "chargeStartMilliSecs" and "lastVoltageChangeMilliSecs".
-void Battery::updateBatteryTimers()
+// Update "microVolts" which is just a smoothed version of hw.readMicroVolts(). 
+// We do a low pass filter to smooth out random variations in the readings.
+// This is probably not necessary because the readings are very stable, 
+// and because we already have a margin of slop.
+// "microAmps" gets the same filter, so that the two stay in step when we use them together.
+void Battery::updateVoltage()
+{
+    const long long lowPassFilterN = 100LL;
+    microVolts = ((microVolts * lowPassFilterN) + hw.readMicroVolts()) / (lowPassFilterN + 1);
+    microAmps = ((microAmps * lowPassFilterN) + hw.readMicroAmps()) / (lowPassFilterN + 1);
+}
+
+void Battery::startChargeWindow()
+{
+    chargeWindowStartMilliSecs = hw.millis();
+    chargeWindowMicroAmpsSum = 0;
+    chargeWindowReadings = 0;
+}
+
+// Track the phases of charging. As described at the top of this file, the charger first pushes a constant
+// current into the battery. This is chargePhaseConstantCurrent. When the battery reaches the charger's maximum
+// voltage, the current starts to taper off. This is chargePhaseConstantVoltage. When the current has tapered
+// down to almost nothing, the battery is full, and we set the coulomb count to 100% of the battery capacity.
+//
+// The current readings are noisy, so we work with the average current over each CHARGE_WINDOW_MILLIS.
+// How fast the average drops from one window to the next tells us roughly how long it will be until the battery is full.
+void Battery::updateChargePhase(long long chargeFlowMicroAmps)
 {
-    bool isChargingNow = isCharging();
-    if (isChargingNow && !prevIsCharging) {
+    if (!isCharging()) {
+        chargePhase = chargePhaseNotCharging;
+        minutesToFull = -1;
+        return;
+    }
+    if (chargePhase == chargePhaseNotCharging) {
         // we have just started charging
+        chargePhase = chargePhaseConstantCurrent;
         chargeStartMilliSecs = hw.millis();
-        //serialPrintf("Start charging at %ld", chargeStartMilliSecs);
+        prevWindowMicroAmps = 0;
+        prevWindowMicroVolts = 0;
+        peakWindowMicroAmps = 0;
+        taperMicroAmpsPerWindow = 0;
+        confirmationWindows = 0;
+        startChargeWindow();
     }
-    prevIsCharging = isChargingNow;
 
-    // Update "microVolts" which is just a smoothed version of hw.readMicroVolts(). 
-    // We do a low pass filter to smooth out random variations in the readings.
-    // This is probably not necessary because the readings are very stable, 
-    // and because we already have a margin of slop.
-    const long long lowPassFilterN = 100LL;
-    microVolts = ((microVolts * lowPassFilterN) + hw.readMicroVolts()) / (lowPassFilterN + 1);
+    chargeWindowMicroAmpsSum += chargeFlowMicroAmps;
+    chargeWindowReadings += 1;
+    if (hw.millis() - chargeWindowStartMilliSecs < CHARGE_WINDOW_MILLIS) {
+        return;
+    }
+    const long windowMicroAmps = (long)(chargeWindowMicroAmpsSum / chargeWindowReadings);
+    startChargeWindow();
+
+    peakWindowMicroAmps = max(peakWindowMicroAmps, windowMicroAmps);
+    const long stepMicroAmps = prevWindowMicroAmps - windowMicroAmps;
+    if (prevWindowMicroAmps != 0) {
+        taperMicroAmpsPerWindow += (stepMicroAmps - taperMicroAmpsPerWindow) / TAPER_AVERAGE_DIVISOR;
+    }
+    const bool voltageIsStable = (prevWindowMicroVolts != 0) && (abs(microVolts - prevWindowMicroVolts) <= STABLE_MICRO_VOLTS);
+    const bool atConstantVoltage = (microVolts >= CONSTANT_VOLTAGE_MIN_MICRO_VOLTS);
+    const bool chargingIsLongEnough = (hw.millis() - chargeStartMilliSecs >= MIN_CONSTANT_CURRENT_MILLIS);
+    // The window average is the current half a window ago. This is what it will be at the end of the next window.
+    const long projectedMicroAmps = windowMicroAmps - max(taperMicroAmpsPerWindow, 0L) * 3L / 2L;
+    prevWindowMicroAmps = windowMicroAmps;
+    prevWindowMicroVolts = microVolts;
+
+    switch (chargePhase) {
+        case chargePhaseConstantCurrent:
+            if (atConstantVoltage && (windowMicroAmps < CONSTANT_CURRENT_MIN_MICRO_AMPS ||
+                windowMicroAmps < peakWindowMicroAmps / 100L * CONSTANT_VOLTAGE_PERCENT_OF_PEAK))
+            {
+                confirmationWindows += 1;
+            } else {
+                confirmationWindows = 0;
+            }
+            if (chargingIsLongEnough && confirmationWindows >= CONSTANT_VOLTAGE_CONFIRMATION_WINDOWS) {
+                chargePhase = chargePhaseConstantVoltage;
+                confirmationWindows = 0;
+            }
+            break;
+
+        case chargePhaseConstantVoltage:
+            if (windowMicroAmps > 0 && projectedMicroAmps < config.chargeMicroAmpsWhenFull && stepMicroAmps >= 0 &&
+                atConstantVoltage && voltageIsStable)
+            {
+                chargePhase = chargePhaseFull;
+                picoCoulombs = capacityPicoCoulombs;
+                chargeIsCalibrated = true;
+                saveCoulombCount();
+            }
+            break;
+
+        default:
+            break;
+    }
+
+    // Estimate the time until full. During constant current, we assume the current continues until the battery
+    // is full, which ignores the taper, so it's on the low side. During constant voltage, we assume the current
+    // keeps dropping at the same rate.
+    switch (chargePhase) {
+        case chargePhaseConstantCurrent:
+            minutesToFull = (windowMicroAmps > 0) ?
+                (int)((capacityPicoCoulombs - picoCoulombs) / windowMicroAmps / PICO_COULOMBS_PER_MICRO_AMP_MINUTE) : -1;
+            break;
 
-    if (abs(microVolts - prevMicroVolts) >= BATTERY_MICRO_VOLTS_CHANGED_THRESHOLD) {
-        // voltage has changed since last time we checked
-        lastVoltageChangeMilliSecs = hw.millis();
-        prevMicroVolts = microVolts;
+        case chargePhaseConstantVoltage:
+            minutesToFull = (taperMicroAmpsPerWindow > 0) ?
+                (int)(max(windowMicroAmps - config.chargeMicroAmpsWhenFull, 0L) / taperMicroAmpsPerWindow / (long)(60000UL / CHARGE_WINDOW_MILLIS)) : -1;
+            break;
+
+        default:
+            minutesToFull = 0;
+            break;
     }
 }
 
@@ -130,63 +483,58 @@ void Battery::update()
         return;
     }
 
-    updateBatteryTimers();
+    updateVoltage();
 
-    // TaKe a sample of the current. Read the clock and the current as close as possible to the same moment.
-    long long nowMicroSecs = hw.micros();
+    // Get the latest current sample, for the charge phase and runtime estimates.
     long long chargeFlowMicroAmps = hw.readMicroAmps();
-    // Note: there is a lot of random variation in charge flow readings (maybe 5-10%).
-    // This is not a problem because the data will get smoothed as we accumulate picoCoulombs
-    // in many small increments.
+    hw.setCurrentSampling((abs(chargeFlowMicroAmps) < PRECISE_SAMPLING_MICRO_AMPS) ? preciseCurrentSampling : fastCurrentSampling);
 
-    // Calculate the time interval between this sample and the previous, then use that to calculate how much charge
-    // has flowed into/outof the battery since the last sample. We will assume that the current remained constant
-    // between the current and previous samples.
-    unsigned long deltaMicroSecs = nowMicroSecs - lastCoulombsUpdateMicroSecs;
-    lastCoulombsUpdateMicroSecs = nowMicroSecs;
-    long long deltaPicoCoulombs = chargeFlowMicroAmps * deltaMicroSecs;
+    // Find out how much charge has flowed into/outof the battery since last time. Hardware does the actual
+    // integration, from current samples taken at regular intervals by an interrupt, so the result doesn't depend
+    // on how often we get called. Note: there is a lot of random variation in the individual samples (maybe 5-10%).
+    // This is not a problem because the data gets smoothed as we accumulate picoCoulombs in many small increments.
+    long long deltaPicoCoulombs = hw.takePicoCoulombs();
+    if (deltaPicoCoulombs > 0) {
+        chargedPicoCoulombs += deltaPicoCoulombs;
+    } else {
+        dischargedPicoCoulombs -= deltaPicoCoulombs;
+    }
+    countedPicoCoulombs += abs(deltaPicoCoulombs);
 
     // update our counter of the battery charge. Don't let the number get out of range.
     picoCoulombs = picoCoulombs + deltaPicoCoulombs;
-    picoCoulombs = constrain(picoCoulombs, 0, BATTERY_CAPACITY_PICO_COULOMBS);
+    picoCoulombs = constrain(picoCoulombs, 0, capacityPicoCoulombs);
+
+    // If we have counted down from a full charge to the known low voltage point, then we have
+    // measured the capacity of the battery. After that we know how much charge is left, so we use that
+    // as the new coulomb count. We don't measure again until the next full charge. The low voltage point
+    // is a rest voltage, so we compare it with the rest voltage, not the voltage under load.
+    if (chargeIsCalibrated && !isCharging() && getRestMicroVolts() < LOW_VOLTAGE_POINT_MICRO_VOLTS) {
+        learnCapacity(capacityPicoCoulombs - picoCoulombs + config.batteryMinChargePicoCoulombs);
+        picoCoulombs = config.batteryMinChargePicoCoulombs;
+        chargeIsCalibrated = false;
+        chargeVariance = MIN_CHARGE_VARIANCE;
+        countedPicoCoulombs = 0;
+        saveCoulombCount();
+    }
  
-    // if the battery is charging, and has now reached the maximum charge,
-    // we will set the battery coulomb counter to 100% of the battery capacity.
-    // We know we've reached the maximum charge when:
-    // 1. the charger is attached, AND
-    // 2. we've been charging for at least a few minutes. AND
-    // 3. the battery voltage hasn't changed for at least a few minutes
-    // 4. the current flow rate is quite low
+    updateChargePhase(chargeFlowMicroAmps);
+
     unsigned long nowMillis = hw.millis();
-    if ((picoCoulombs != BATTERY_CAPACITY_PICO_COULOMBS) &&
-        isCharging() &&                                                              // ...the charger is attached, AND
-        ((nowMillis - chargeStartMilliSecs) > CHARGER_WINDDOWN_TIME_MILLIS) &&       // ...we've been charging for a few minutes, AND
-        ((nowMillis - lastVoltageChangeMilliSecs) > CHARGER_WINDDOWN_TIME_MILLIS) && // ...the battery voltage hasn't changed for a few minutes, AND
-        (chargeFlowMicroAmps < CHARGE_MICRO_AMPS_WHEN_FULL))                         // ...the current flow rate is quite low
-    {
-        // Our 4-point check has passed. So we are probably finished charging. However,
-        // because of random fluctuations in the current measurements, we might not be
-        // *completely* finished. Let's see if we stay in the "charge finished" state
-        // for a few seconds.
-        if (maybeChargingFinished) {
-            if (nowMillis - maybeChargingFinishedMilliSecs > 5000L) {
-                // We've been in "charge finished" state for long enough. It's now safe
-                // to assume that the battery is fully charged.
-                picoCoulombs = BATTERY_CAPACITY_PICO_COULOMBS;
-                maybeChargingFinished = false;
-            }
-        } else {
-            maybeChargingFinished = true;
-            maybeChargingFinishedMilliSecs = nowMillis;
+    if (nowMillis - lastRuntimeUpdateMilliSecs >= RUNTIME_UPDATE_INTERVAL_MILLIS) {
+        lastRuntimeUpdateMilliSecs = nowMillis;
+        if (VOLTAGE_CORRECTION_ENABLED && !chargeIsCalibrated && !isCharging() && !fanSettling) {
+            correctFromVoltage();
         }
-    } else {
-        maybeChargingFinished = false;
+        updateRuntimeEstimate(chargeFlowMicroAmps);
     }
+
+    maybeSaveCoulombCount();
 }
 
 void Battery::DEBUG_incrementPicoCoulombs(long long increment)
 {
     picoCoulombs += increment;
-    picoCoulombs = constrain(picoCoulombs, 0, BATTERY_CAPACITY_PICO_COULOMBS);
+    picoCoulombs = constrain(picoCoulombs, 0, capacityPicoCoulombs);
 }
 
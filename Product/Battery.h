@@ -5,6 +5,13 @@
  * The Battery class encapsulates all the code that manages the battery. This class provides
  * 2 key pieces of information: (1) how full is the battery? (2) is the charger attached? 
  */
+#include "EEPROMJournal.h"
+
+// How many different fan speeds there are. The battery keeps separate statistics for each one.
+const int BATTERY_NUM_FAN_SPEEDS = 3;
+
+// The phases of charging. See Battery.cpp for an explanation.
+enum ChargePhase { chargePhaseNotCharging, chargePhaseConstantCurrent, chargePhaseConstantVoltage, chargePhaseFull };
 
 class Battery {
 public:
@@ -14,6 +21,13 @@ public:
     // Is the charger currently connected?
     bool isCharging();
 
+    // Which phase of charging is the battery in?
+    ChargePhase getChargePhase() { return chargePhase; }
+
+    // How many minutes until the battery is fully charged? Returns -1 if we don't know, for example
+    // when the charger isn't connected. This is a rough estimate.
+    int getMinutesToFull() { return minutesToFull; }
+
     // How much charge is currently in the battery? 
     //
     // You should not assume that this is accurate to within a picoCoulomb. The accuracy depends on
@@ -23,39 +37,121 @@ public:
     // "double" because our C++ compiler doesn't fully support double.
     long long getPicoCoulombs() { return picoCoulombs; }
 
+    // How much charge does the battery hold when it's full? This starts out as the nominal capacity,
+    // config.batteryCapacityPicoCoulombs, and adapts to the actual battery as it goes through charge cycles.
+    long long getCapacityPicoCoulombs() { return capacityPicoCoulombs; }
+
+    // How many minutes until the battery is empty, at the current load? Returns -1 if we don't know,
+    // for example when the charger is connected.
+    int getMinutesRemaining() { return minutesRemaining; }
+
+    // Tell the battery which fan speed is in use, 0 to BATTERY_NUM_FAN_SPEEDS - 1. We keep a separate
+    // discharge current estimate for each fan speed, so the runtime estimate is right as soon as the speed changes.
+    void setFanSpeed(int speed) { fanSpeed = speed; }
+
+    // Tell the battery whether the fan is still changing speed. The current is not typical of either speed while the
+    // fan ramps up or down, so the discharge current averages ignore it until the fan has settled.
+    void setFanSettling(bool settling) { fanSettling = settling; }
+
     // You must call this function periodically, ideally every few milliseconds. Exception: we don't
     // expect you to call it when the system is sleeping (and therefore consuming neglible power).
     void update();
 
-    // You must call this function when the system wakes up from sleeping.
-    void wakeUp();
+    // You must call this function when the system wakes up from sleeping. Tell it how long the system slept,
+    // so it can take away the charge that was used during the sleep.
+    void wakeUp(unsigned long sleptMillis);
 
     // For testing and debugging: change the current coulomb count, to fool the system into
     // thinking the battery is more (or less) charged that it really is.
     void DEBUG_incrementPicoCoulombs(long long increment);
 
-    // When the system is starting up, call this function.
-    void initializeCoulombCount();
+    // When the system is starting up, call this function. It restores the coulomb count that was saved
+    // in EEPROM before the reset. If the battery may have been disconnected (and therefore maybe
+    // swapped or charged elsewhere), we only trust the saved count if it agrees with the battery voltage.
+    void initializeCoulombCount(bool batteryMayHaveChanged);
+
+    // After a reset that didn't lose power, the caller may have a more recent coulomb count than
+    // the one saved in EEPROM. Call this after initializeCoulombCount() to use it.
+    void resumeCoulombCount(long long savedPicoCoulombs, bool calibrated);
+
+    // Is the coulomb count based on a full charge (true), or only estimated from the battery voltage (false)?
+    bool isCalibrated() { return chargeIsCalibrated; }
+
+    // Save the coulomb count to EEPROM right now, for example before the system goes to sleep.
+    // (The count is also saved periodically by update().)
+    void saveCoulombCount();
+
+    // How much charge has flowed into and out of the battery since the last call, for the usage statistics.
+    // Both amounts are positive. The charge that the system uses while sleeping counts as flowing out.
+    void takeChargeFlow(long long* inPicoCoulombs, long long* outPicoCoulombs);
 
 private:
-    // Update the timer information that we use to determine when the battery is fully charged.
-    void updateBatteryTimers();
+    // Update "microVolts" and "microAmps", the smoothed battery voltage and current.
+    void updateVoltage();
+
+    // Estimate the battery's rest (open-circuit) voltage from microVolts and microAmps, by adding back the
+    // drop across BATTERY_RESISTANCE_MILLI_OHMS. This is what the voltage tables are based on.
+    long long getRestMicroVolts();
+
+    // Track the phase of charging, and recognize when the battery is full.
+    void updateChargePhase(long long chargeFlowMicroAmps);
+
+    // Start a new averaging window for updateChargePhase().
+    void startChargeWindow();
 
     // When the system first starts up, we have no idea how much charge is in the battery.
-    // This function estimates the charge based on the voltage reading. This is a rough
-    // estimate based on measurements from a "typical" battery. It is not very reliable
-    // because of the nature of Li-ion batteries, but it's better than nothing. Anyway,
-    // we only rely on the estimate until the first time the battery becomes fully charged,
-    // at which time we know how much charge it has.
+    // This function estimates the charge based on the voltage reading, by looking it up in a table
+    // of measurements from a "typical" battery. It is not very reliable because of the nature of
+    // Li-ion batteries, but it's better than nothing. Anyway, we only rely on the estimate until the
+    // first time the battery becomes fully charged, at which time we know how much charge it has.
     static long long estimatePicoCoulombsFromVoltage(long long microVolts);
 
+    // Save the coulomb count to EEPROM if it has changed enough since the last time we saved it.
+    void maybeSaveCoulombCount();
+
+    // Adjust the learned capacity, given a new measurement of the capacity.
+    void learnCapacity(long long measuredPicoCoulombs);
+
+    // Update the average discharge current and the time remaining, given the latest current reading.
+    void updateRuntimeEstimate(long long chargeFlowMicroAmps);
+
+    // Nudge an uncalibrated coulomb count towards the estimate from the battery voltage.
+    void correctFromVoltage();
+
+    // This is what we save in EEPROM.
+    struct SavedCharge {
+        long long picoCoulombs;
+        bool calibrated;
+    };
+
     long long picoCoulombs; // How much charge is in the battery right now.
+    bool chargeIsCalibrated; // True if picoCoulombs has been counted down from a full charge, rather than estimated from the voltage.
+    long chargeVariance;     // How uncertain picoCoulombs is, as a variance in coulombs squared. Only used when uncalibrated.
+    long long capacityPicoCoulombs;         // The learned capacity of the battery
+    EEPROMJournal capacityJournal;          // Where we save capacityPicoCoulombs
+    long dischargeMicroAmps[BATTERY_NUM_FAN_SPEEDS]; // Average discharge current for each fan speed, or 0 if not yet known
+    int fanSpeed;                           // Which fan speed is in use
+    bool fanSettling;                       // Is the fan changing speed?
+    int minutesRemaining;                   // Time until empty, at the current load, or -1 if unknown
+    unsigned long lastRuntimeUpdateMilliSecs; // millisecond timestamp of when we last updated minutesRemaining
+    EEPROMJournal savedChargeJournal;       // Where we save picoCoulombs, so that it survives a reset
+    long long savedPicoCoulombs;            // What we last saved in savedChargeJournal
+    long long saveChangePicoCoulombs;       // How much picoCoulombs must change before we save it again
+    unsigned long lastSaveMilliSecs;        // millisecond timestamp of when we last saved to savedChargeJournal
     long long microVolts;   // The voltage right now.
-    unsigned long lastCoulombsUpdateMicroSecs;// microsecond timestamp of when we last sampled the current flow
-    unsigned long chargeStartMilliSecs;       // millisecond timestamp of when the battery charger started up
-    unsigned long lastVoltageChangeMilliSecs; // millisecond timestamp of when the battery voltage last changed
-    bool prevIsCharging;      // what was "isCharging" the last time we checked
-    long long prevMicroVolts; // what was "microVolts" the last time we checked
-    bool maybeChargingFinished;  // If true, then we suspect that the battery is now fully charged
-    unsigned long maybeChargingFinishedMilliSecs;  // millisecond timestamp of when we first suspected charge done
+    long long microAmps;    // The current right now, smoothed like microVolts. Positive when charging.
+    long long countedPicoCoulombs; // How much charge we have counted, in or out, since the last correctFromVoltage()
+    long long chargedPicoCoulombs;    // The charge that has flowed in since the last takeChargeFlow()
+    long long dischargedPicoCoulombs; // The charge that has flowed out since the last takeChargeFlow()
+    ChargePhase chargePhase;                  // which phase of charging we're in
+    int minutesToFull;                        // Time until fully charged, or -1 if unknown
+    unsigned long chargeWindowStartMilliSecs; // millisecond timestamp of when the current averaging window started
+    long long chargeWindowMicroAmpsSum;       // the sum of the current readings in this averaging window
+    long chargeWindowReadings;                // how many readings are in chargeWindowMicroAmpsSum
+    long prevWindowMicroAmps;                 // the average current in the previous window, or 0 if none
+    long peakWindowMicroAmps;                 // the highest window average since the charger was connected
+    long taperMicroAmpsPerWindow;             // how much the current drops in each window, smoothed
+    long long prevWindowMicroVolts;           // the voltage at the end of the previous window, or 0 if none
+    unsigned long chargeStartMilliSecs;       // millisecond timestamp of when charging started
+    int confirmationWindows;                  // how many windows in a row have looked like the next phase
 };
\ No newline at end of file
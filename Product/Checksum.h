@@ -0,0 +1,25 @@
+// A CRC-16 checksum, used to detect corrupted data in EEPROM and in memory that survives a reset.
+// We use the CCITT polynomial, via the fast implementation in the AVR C library.
+#pragma once
+#ifdef UNITTEST
+#include "ArduinoDefs.h"
+#else
+#include <util/crc16.h>
+#endif
+
+// Add one byte to a running checksum.
+inline uint16_t updateChecksum(uint16_t checksum, uint8_t data)
+{
+    return _crc_ccitt_update(checksum, data);
+}
+
+// Calculate the checksum of a block of memory.
+inline uint16_t checksum(const void* data, int size)
+{
+    uint16_t result = 0xffff;
+    const uint8_t* p = (const uint8_t*)data;
+    while (size--) {
+        result = updateChecksum(result, *p++);
+    }
+    return result;
+}
@@ -0,0 +1,155 @@
+/*
+ * Config.cpp
+ */
+#include "Config.h"
+#include "Checksum.h"
+#include "MySerial.h"
+#ifndef UNITTEST
+#include <avr/pgmspace.h>
+#endif
+
+#define hw Hardware::instance
+
+Config Config::instance;
+
+// The default settings.
+const ConfigData CONFIG_DEFAULTS PROGMEM = {
+    CONFIG_VERSION,
+
+    // When we change the fan speed, the FanController ramps the duty cycle at this rate (percent per second),
+    // to limit the inrush current from the battery.
+    100,
+
+    // When we change the fan speed, we don't check the RPM until the FanController says the speed has settled.
+    // That usually takes about a second after the ramp finishes. If the speed still hasn't settled after this many
+    // milliseconds, something is wrong, so we check it anyway.
+    6000,
+
+    // The user must push a button for at least this many milliseconds.
+    1000,
+
+    // The power off button needs a very short debounce interval (in milliseconds),
+    // so it can do a little song and dance before taking effect.
+    50,
+
+    // The power off button only takes effect if the user holds it pressed for at least this many milliseconds.
+    1000,
+
+    // A "low battery" alarm is in effect whenever the battery level is at or below the "urgent" amount.
+    // If a charger is connected then the red LED flashes until the level is above the urgent amount,
+    // but the buzzer doesn't sound.
+    // The alarm is supposed to occur when the battery has 30 minutes of charge left at the current load. To give a
+    // generous margin, it's actually an hour. When we don't have an estimate of the time remaining (for example,
+    // when the charger is connected), we use a percentage instead, which is about an hour at a typical load.
+    60, 8,
+
+    // The charge reminder beeps when the battery level is at or below this amount (minutes, percent).
+    // 15 percent is what the reminder has always used. It's about two hours at a typical load, like the
+    // urgent level's 8 percent is about an hour, so the reminder's time is twice the urgent level's time.
+    120, 15,
+
+    // When the charge current stays below this many microamps, the battery is full.
+    200000L,
+
+    // The battery parameters and ADC scale factors for this board. See Hardware.h.
+    BATTERY_SLEEP_MICRO_AMPS,
+    BATTERY_CAPACITY_PICO_COULOMBS,
+    BATTERY_MIN_CHARGE_PICO_COULOMBS,
+    NANO_AMPS_PER_CHARGE_FLOW_UNIT,
+    NANO_VOLTS_PER_VOLTAGE_UNIT
+};
+
+// Replace "value" with "defaultValue" if it's outside low to high. Returns 1 if it was replaced, 0 if not.
+template <typename T>
+static byte checkRange(T& value, const T& defaultValue, long long low, long long high)
+{
+    if ((long long)value < low || (long long)value > high) {
+        value = defaultValue;
+        return 1;
+    }
+    return 0;
+}
+
+Config::Config() : overridden(false), replacedSettings(0)
+{
+    memcpy_P(static_cast<ConfigData*>(this), &CONFIG_DEFAULTS, sizeof(ConfigData));
+}
+
+// The saved settings are followed by a checksum. We read them all with a single EEPROM read.
+void Config::load()
+{
+    struct {
+        ConfigData data;
+        uint16_t checksum;
+    } saved;
+    hw.readEEPROM(EEPROM_CONFIG_ADDRESS, &saved, sizeof(saved));
+    if (saved.checksum == checksum(&saved.data, sizeof(ConfigData)) && saved.data.version == CONFIG_VERSION) {
+        replacedSettings = validate(saved.data);
+        *static_cast<ConfigData*>(this) = saved.data;
+        overridden = true;
+    }
+}
+
+// The ranges are wide enough for any sensible tuning, and narrow enough that the firmware still works. Some
+// ranges depend on other settings, which are checked first.
+byte Config::validate(ConfigData& data)
+{
+    ConfigData defaults;
+    memcpy_P(&defaults, &CONFIG_DEFAULTS, sizeof(ConfigData));
+    byte replaced = 0;
+
+    // Fan. A slew rate of 0 means no ramp.
+    replaced += checkRange(data.fanSlewPercentPerSecond, defaults.fanSlewPercentPerSecond, 0, 1000);
+    replaced += checkRange(data.fanMaxSettleMillis, defaults.fanMaxSettleMillis, 1000, 30000);
+
+    // Buttons
+    replaced += checkRange(data.buttonDebounceMillis, defaults.buttonDebounceMillis, 10, 5000);
+    replaced += checkRange(data.powerOffButtonDebounceMillis, defaults.powerOffButtonDebounceMillis, 10, 1000);
+    replaced += checkRange(data.powerOffButtonHoldMillis, defaults.powerOffButtonHoldMillis, 100, 10000);
+
+    // Alerts. A level of 0 would never raise the alarm. The reminder must come before the urgent alarm.
+    replaced += checkRange(data.urgentBatteryMinutes, defaults.urgentBatteryMinutes, 1, 240);
+    replaced += checkRange(data.urgentBatteryPercent, defaults.urgentBatteryPercent, 1, 50);
+    replaced += checkRange(data.reminderBatteryMinutes, defaults.reminderBatteryMinutes, data.urgentBatteryMinutes, 255);
+    replaced += checkRange(data.reminderBatteryPercent, defaults.reminderBatteryPercent, data.urgentBatteryPercent, 100);
+    if (data.reminderBatteryMinutes < data.urgentBatteryMinutes || data.reminderBatteryPercent < data.urgentBatteryPercent) {
+        // The default reminder is below a custom urgent level.
+        data.reminderBatteryMinutes = data.urgentBatteryMinutes;
+        data.reminderBatteryPercent = data.urgentBatteryPercent;
+    }
+
+    // Battery. The capacity must be above the minimum charge, or getBatteryPercentFull() divides by zero.
+    replaced += checkRange(data.chargeMicroAmpsWhenFull, defaults.chargeMicroAmpsWhenFull, 10000L, 2000000L);
+    replaced += checkRange(data.batterySleepMicroAmps, defaults.batterySleepMicroAmps, 0, 100000L);
+    replaced += checkRange(data.batteryCapacityPicoCoulombs, defaults.batteryCapacityPicoCoulombs,
+        defaults.batteryCapacityPicoCoulombs / 4, defaults.batteryCapacityPicoCoulombs * 4);
+    replaced += checkRange(data.batteryMinChargePicoCoulombs, defaults.batteryMinChargePicoCoulombs,
+        0, data.batteryCapacityPicoCoulombs / 2);
+
+    // ADC scale factors. The parts tolerances are a few percent, so anything more than 25% off is a mistake.
+    replaced += checkRange(data.nanoAmpsPerChargeFlowUnit, defaults.nanoAmpsPerChargeFlowUnit,
+        defaults.nanoAmpsPerChargeFlowUnit * 3 / 4, defaults.nanoAmpsPerChargeFlowUnit * 5 / 4);
+    replaced += checkRange(data.nanoVoltsPerVoltageUnit, defaults.nanoVoltsPerVoltageUnit,
+        defaults.nanoVoltsPerVoltageUnit * 3 / 4, defaults.nanoVoltsPerVoltageUnit * 5 / 4);
+
+    return replaced;
+}
+
+void Config::save(const ConfigData& data)
+{
+    const uint16_t dataChecksum = checksum(&data, sizeof(ConfigData));
+    hw.writeEEPROM(EEPROM_CONFIG_ADDRESS, &data, sizeof(ConfigData));
+    hw.writeEEPROM(EEPROM_CONFIG_ADDRESS + sizeof(ConfigData), &dataChecksum, sizeof(dataChecksum));
+}
+
+void Config::erase()
+{
+    // A version of 0 never matches, so the saved settings are ignored.
+    const uint16_t noVersion = 0;
+    hw.writeEEPROM(EEPROM_CONFIG_ADDRESS + offsetof(ConfigData, version), &noVersion, sizeof(noVersion));
+}
+
+void Config::dump()
+{
+    serialPrintf("Config version %u, %s, %u out of range", version, overridden ? "from EEPROM" : "defaults", replacedSettings);
+}
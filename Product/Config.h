@@ -0,0 +1,85 @@
+#pragma once
+/*
+ * Config.h
+ *
+ * The configuration holds the tunable settings of the firmware, such as button timings, alert thresholds,
+ * battery parameters, and ADC scale factors, so that units can be tuned for a deployment without rebuilding
+ * the firmware. The defaults live in program memory. A unit can have its own settings in EEPROM, which
+ * override the defaults if they have the right version and a good checksum. Each saved setting that's out of
+ * its sensible range is replaced by its default, so a bad value can't stop the alarms or divide by zero.
+ *
+ * The settings are copied into RAM once, at startup, so reading them costs no more than reading a variable.
+ * Use them like this:
+ *
+ *     #include "Config.h"
+ *     ... config.buttonDebounceMillis ...
+ */
+#include "Hardware.h"
+
+// The version of the ConfigData layout. Change this whenever you add, remove, or change the meaning of a field,
+// so that units ignore settings that were saved for a different layout.
+const uint16_t CONFIG_VERSION = 1;
+
+// All the settings. See CONFIG_DEFAULTS in Config.cpp for their meanings and default values.
+struct ConfigData {
+    uint16_t version;
+
+    // Fan
+    uint16_t fanSlewPercentPerSecond;
+    uint16_t fanMaxSettleMillis;
+
+    // Buttons
+    uint16_t buttonDebounceMillis;
+    uint16_t powerOffButtonDebounceMillis;
+    uint16_t powerOffButtonHoldMillis;
+
+    // Alerts
+    byte urgentBatteryMinutes;
+    byte urgentBatteryPercent;
+    byte reminderBatteryMinutes;
+    byte reminderBatteryPercent;
+
+    // Battery
+    long chargeMicroAmpsWhenFull;
+    long batterySleepMicroAmps;
+    long long batteryCapacityPicoCoulombs;
+    long long batteryMinChargePicoCoulombs;
+
+    // ADC scale factors
+    long nanoAmpsPerChargeFlowUnit;
+    long nanoVoltsPerVoltageUnit;
+};
+
+class Config : public ConfigData {
+public:
+    // Start out with the default settings.
+    Config();
+
+    // Replace the defaults with the settings saved in EEPROM, if there are any. Call this first thing in setup().
+    void load();
+
+    // Replace each setting in "data" that's out of range with its default. Returns how many were replaced,
+    // so 0 means the settings were all good. The version isn't checked.
+    static byte validate(ConfigData& data);
+
+    // Save settings in EEPROM. They take effect the next time the MCU starts up. Check them with validate() first.
+    void save(const ConfigData& data);
+
+    // Remove the settings saved in EEPROM, so the defaults take effect the next time the MCU starts up.
+    void erase();
+
+    // Are we using settings from EEPROM (true), or the defaults (false)?
+    bool isOverridden() { return overridden; }
+
+    // Write the settings to the serial port.
+    void dump();
+
+    // The one and only instance of Config.
+    static Config instance;
+
+private:
+    bool overridden;
+    byte replacedSettings; // how many saved settings were out of range
+};
+
+#define config Config::instance
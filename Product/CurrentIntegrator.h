@@ -0,0 +1,26 @@
+// The arithmetic that Hardware's sampling interrupts use to integrate the battery current. It's kept
+// separate, with no hardware dependencies, so the desktop tests can benchmark exactly the same code.
+#pragma once
+
+// Current samples are kept as 64 times the difference between the reference and current readings.
+const long CURRENT_SCALE = 64;
+
+// Convert the sum of a burst of conversions (current pin minus reference pin) into a sample at CURRENT_SCALE.
+// Every burst size divides CURRENT_SCALE, so all samples have the same scale.
+inline long scaleCurrentSample(long currentMinusReferenceSum, int conversions)
+{
+    return currentMinusReferenceSum * (CURRENT_SCALE / conversions);
+}
+
+// Twice the area of the trapezoid between two samples that are widthMicros apart, in scaled units times
+// microseconds. Add these up, then convert the total with scaledUnitMicrosToPicoCoulombs().
+inline long long trapezoidScaledUnitMicros(long prevScaledUnits, long scaledUnits, long widthMicros)
+{
+    return (long long)(prevScaledUnits + scaledUnits) * widthMicros;
+}
+
+// Convert a sum of trapezoidScaledUnitMicros() into picocoulombs.
+inline long long scaledUnitMicrosToPicoCoulombs(long long scaledUnitMicros, long long nanoAmpsPerChargeFlowUnit)
+{
+    return (scaledUnitMicros * nanoAmpsPerChargeFlowUnit) / (2000LL * CURRENT_SCALE);
+}
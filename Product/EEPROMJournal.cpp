@@ -0,0 +1,119 @@
+/*
+ * EEPROMJournal.cpp
+ */
+#include "EEPROMJournal.h"
+#include "Checksum.h"
+
+#define hw Hardware::instance
+
+// Each slot is laid out like this:
+//     sequence number - 2 bytes
+//     record          - recordSize bytes
+//     checksum        - 2 bytes, covering the sequence number and the record
+// A slot that has never been written contains all 0xFF bytes, so we never use 0xFFFF as a sequence number.
+const uint16_t ERASED_SEQUENCE = 0xffff;
+
+EEPROMJournal::EEPROMJournal(int address, int size, byte recordSize) :
+    address(address),
+    slotCount(size / (sizeof(uint16_t) + recordSize + sizeof(uint16_t))),
+    recordSize(recordSize),
+    nextSlot(0),
+    nextSequence(0),
+    ready(false)
+{ }
+
+// Check if a slot contains a valid record. If so, return true and its sequence number.
+bool EEPROMJournal::readSlot(byte slot, uint16_t* sequence)
+{
+    int a = slotAddress(slot);
+    hw.readEEPROM(a, sequence, sizeof(uint16_t));
+    if (*sequence == ERASED_SEQUENCE) {
+        return false;
+    }
+
+    uint16_t sum = checksum(sequence, sizeof(uint16_t));
+    a += sizeof(uint16_t);
+    for (byte i = 0; i < recordSize; i += 1) {
+        byte data;
+        hw.readEEPROM(a++, &data, 1);
+        sum = updateChecksum(sum, data);
+    }
+
+    uint16_t savedSum;
+    hw.readEEPROM(a, &savedSum, sizeof(uint16_t));
+    return sum == savedSum;
+}
+
+bool EEPROMJournal::read(void* record)
+{
+    bool found = false;
+    byte newestSlot = 0;
+    uint16_t newestSequence = 0;
+    for (byte slot = 0; slot < slotCount; slot += 1) {
+        uint16_t sequence;
+        // The sequence number wraps around, so "newer" means "a little bit bigger, modulo 2**16".
+        if (readSlot(slot, &sequence) && (!found || (int16_t)(sequence - newestSequence) > 0)) {
+            found = true;
+            newestSlot = slot;
+            newestSequence = sequence;
+        }
+    }
+
+    ready = true;
+    if (!found) {
+        nextSlot = 0;
+        nextSequence = 0;
+        return false;
+    }
+
+    hw.readEEPROM(slotAddress(newestSlot) + sizeof(uint16_t), record, recordSize);
+    nextSlot = (newestSlot + 1) % slotCount;
+    nextSequence = newestSequence + 1;
+    return true;
+}
+
+bool EEPROMJournal::readOlder(byte age, void* record)
+{
+    if (!ready || age >= slotCount) {
+        return false;
+    }
+
+    // The slots are written in order around the ring, so the record we want is "age" slots before the newest one.
+    // Make sure it really is that old: it might never have been written, or might have failed its checksum.
+    // (write() skips ERASED_SEQUENCE, which is why we allow one extra.)
+    const byte slot = (nextSlot + slotCount - 1 - age) % slotCount;
+    uint16_t sequence;
+    if (!readSlot(slot, &sequence)) {
+        return false;
+    }
+    const uint16_t writesAgo = nextSequence - sequence;
+    if (writesAgo < age + 1 || writesAgo > age + 2) {
+        return false;
+    }
+
+    hw.readEEPROM(slotAddress(slot) + sizeof(uint16_t), record, recordSize);
+    return true;
+}
+
+void EEPROMJournal::write(const void* record)
+{
+    if (!ready) {
+        return;
+    }
+    if (nextSequence == ERASED_SEQUENCE) {
+        nextSequence = 0;
+    }
+    uint16_t sum = checksum(&nextSequence, sizeof(uint16_t));
+    const byte* p = (const byte*)record;
+    for (byte i = 0; i < recordSize; i += 1) {
+        sum = updateChecksum(sum, p[i]);
+    }
+
+    const int a = slotAddress(nextSlot);
+    hw.writeEEPROM(a, &nextSequence, sizeof(uint16_t));
+    hw.writeEEPROM(a + sizeof(uint16_t), record, recordSize);
+    hw.writeEEPROM(a + sizeof(uint16_t) + recordSize, &sum, sizeof(uint16_t));
+
+    nextSlot = (nextSlot + 1) % slotCount;
+    nextSequence += 1;
+}
@@ -0,0 +1,43 @@
+/*
+ * EEPROMJournal.h
+ *
+ * An EEPROMJournal saves a small record in EEPROM, in a way that spreads the writes across many "slots".
+ * Each EEPROM byte can only be written about 100,000 times, so if we kept writing a frequently changing record
+ * to the same place, that place would wear out. Instead, each write goes to the next slot in a ring, along with
+ * a sequence number and a checksum. To read the record we look for the valid slot with the newest sequence
+ * number. If the power fails in the middle of a write, the checksum of that slot will be wrong, and
+ * we get the previous record instead.
+ */
+#pragma once
+#include "Hardware.h"
+
+class EEPROMJournal {
+public:
+    // The journal uses "size" bytes of EEPROM starting at "address". It holds records of "recordSize" bytes.
+    EEPROMJournal(int address, int size, byte recordSize);
+
+    // Copy the newest valid record into "record". Returns false if there is no valid record, for example if
+    // nothing has ever been written. You must call this once, before the first call to write().
+    bool read(void* record);
+
+    // Copy an older record into "record". "age" says how many writes ago it was written: age 0 is the newest
+    // record, age 1 is the one before that, and so on. Only the last few records are kept, one per slot.
+    // Returns false if there is no such record. You must call read() first.
+    bool readOlder(byte age, void* record);
+
+    // Write a record into the next slot. This takes about 3.4 milliseconds per byte.
+    // This does nothing if read() hasn't been called, because we wouldn't know which slot is next, and might
+    // overwrite the newest record.
+    void write(const void* record);
+
+private:
+    int slotAddress(byte slot) { return address + slot * (sizeof(uint16_t) + recordSize + sizeof(uint16_t)); }
+    bool readSlot(byte slot, uint16_t* sequence);
+
+    int address;           // where in EEPROM the first slot is
+    byte slotCount;        // how many slots there are
+    byte recordSize;       // how many bytes of data are in each record
+    byte nextSlot;         // where the next write goes
+    uint16_t nextSequence; // the sequence number of the next write
+    bool ready;            // read() has found nextSlot and nextSequence
+};
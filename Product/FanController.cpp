@@ -2,14 +2,73 @@
 #include "FanController.h"
 #include "MySerial.h"
 #include "Hardware.h"
+#ifndef UNITTEST
+#include <avr/pgmspace.h>
+#endif
 
 #define hw Hardware::instance
 
-FanController::FanController(byte sensorPin, unsigned int sensorThreshold, byte pwmPin)
+// Here are measured values for fan RPM for the San Ace 9GA0412P3K011. We use the averages, with +/- 5%
+// tolerance, as the fan curve for any unit that doesn't have its own. These were measured with Arduino's
+// default 490 Hz PWM. The fan's speed at a given duty cycle may be a little different with our 25 kHz PWM,
+// so it's best to run the Calibrator's sweep on every unit.
+//   %    MIN     MAX     AVG
+//
+//   0,    7461,   7480,    7479
+//  10,    9431,   9481,    9456
+//  20,   11264,  11284,   11274
+//  30,   12908,  12947,   12928
+//  40,   14580,  14626,   14603
+//  50,   16047,  16177,   16112
+//  60,   17682,  17743,   17743
+//  70,   19092,  19150,   19121
+//  80,   20408,  20488,   20448
+//  90,   21510,  21556,   21533
+// 100,   22215,  22327,   22271
+const FanCurvePoint defaultCurve[FAN_CURVE_POINTS] PROGMEM = {
+	{  7479,  374, 0 },
+	{  9456,  473, 0 },
+	{ 11274,  564, 0 },
+	{ 12928,  646, 0 },
+	{ 14603,  730, 0 },
+	{ 16112,  806, 0 },
+	{ 17743,  887, 0 },
+	{ 19121,  956, 0 },
+	{ 20448, 1022, 0 },
+	{ 21533, 1077, 0 },
+	{ 22271, 1114, 0 },
+};
+
+// The fan has settled when the standard deviation of the RPM readings in the window is less than this,
+// in percent of their average. At low speed, one count in a short interval is about 1.6%.
+const unsigned long FAN_SETTLED_PERCENT = 3;
+
+// The fan health statistics are saved after this many calls to updateHealth(), which is an hour.
+const unsigned int FAN_HEALTH_READINGS_PER_HOUR = 3600;
+
+FanController::FanController(byte sensorPin, unsigned int sensorThreshold, byte pwmPin) :
+	_curveJournal(EEPROM_FAN_CURVE_ADDRESS, EEPROM_FAN_CURVE_SIZE, sizeof(_curve)),
+	_healthJournal(EEPROM_FAN_HEALTH_ADDRESS, EEPROM_FAN_HEALTH_SIZE, sizeof(FanHealthRecord)),
+	_healthDayJournal(EEPROM_FAN_HEALTH_DAYS_ADDRESS, EEPROM_FAN_HEALTH_DAYS_SIZE, sizeof(FanHealthDayRecord))
 {
 	_sensorPin = sensorPin;
 	_sensorThreshold = sensorThreshold;
 	_pwmPin = pwmPin;
+	_lastReading = 0;
+	_windowIndex = 0;
+	_readingsSinceChange = 0;
+	_slewRate = 0;
+	_dutyCycle = 0;
+	_targetDutyCycle = 0;
+	for (byte i = 0; i < FAN_RPM_WINDOW; i++) {
+		_windowHalfRevs[i] = 0;
+		_windowMillis[i] = 0;
+	}
+	memset(_healthSums, 0, sizeof(_healthSums));
+	memset(_daySums, 0, sizeof(_daySums));
+	_healthSeconds = 0;
+	_healthHour = 0;
+	_dayHours = 0;
 	hw.pinMode(pwmPin, OUTPUT);
 }
 
@@ -18,24 +77,241 @@ void FanController::begin()
 	hw.digitalWrite(_sensorPin, HIGH);
 	setDutyCycle(100);
 	_attachInterrupt();
+
+	if (!_curveJournal.read(_curve)) {
+		memcpy_P(_curve, defaultCurve, sizeof(_curve));
+	}
+
+	FanHealthRecord record;
+	if (_healthJournal.read(&record)) {
+		_healthHour = record.hour;
+	}
+	FanHealthDayRecord day;
+	if (_healthDayJournal.read(&day) && day.hour > _healthHour) {
+		_healthHour = day.hour;
+	}
 }
 
+void FanController::update() {
+	// Take as many steps along the ramp as the slew rate allows for the time that has gone by.
+	if (_dutyCycle != _targetDutyCycle) {
+		const unsigned long steps = (hw.millis() - _rampMillis) * _slewRate / 1000;
+		if (steps > 0) {
+			const byte distance = _dutyCycle < _targetDutyCycle ? _targetDutyCycle - _dutyCycle : _dutyCycle - _targetDutyCycle;
+			const byte step = (byte)min(steps, (unsigned long)distance);
+			_writeDutyCycle(_dutyCycle < _targetDutyCycle ? _dutyCycle + step : _dutyCycle - step);
+			_rampMillis += steps * 1000 / _slewRate;
+		}
+	}
+	getRPM();
+}
+
+// Instead of counting for a whole sensorThreshold and then starting over, we count for short intervals and keep the
+// last FAN_RPM_WINDOW of them. The RPM is the average over the window, so it's just as smooth as before, but
+// it follows changes in speed a few times faster.
 unsigned int FanController::getRPM() {
 	unsigned long elapsed = hw.millis() - _lastMillis;
-	if (elapsed > _sensorThreshold)
+	if (elapsed > _sensorThreshold / FAN_RPM_WINDOW)
 	{
 		noInterrupts();
-		float correctionFactor = 1000.0 / elapsed;
-		_lastReading = correctionFactor * _halfRevs / 2 * 60;
+		_windowHalfRevs[_windowIndex] = _halfRevs;
 		_halfRevs = 0;
 		_lastMillis = hw.millis();
 		interrupts();
+		_windowMillis[_windowIndex] = (unsigned int)elapsed;
+		_windowIndex = (_windowIndex + 1) % FAN_RPM_WINDOW;
+		if (_readingsSinceChange < FAN_RPM_WINDOW) {
+			_readingsSinceChange++;
+		}
+
+		// There are 2 half revolutions per revolution, and 60000 milliseconds per minute.
+		unsigned long halfRevs = 0;
+		unsigned long millis = 0;
+		for (byte i = 0; i < FAN_RPM_WINDOW; i++) {
+			halfRevs += _windowHalfRevs[i];
+			millis += _windowMillis[i];
+		}
+		_lastReading = millis ? (unsigned int)(halfRevs * 30000UL / millis) : 0;
 	}
 	return _lastReading;
 }
 
+// The RPM measured over one interval of the window.
+unsigned int FanController::_windowRPM(byte index) {
+	return _windowMillis[index] ? (unsigned int)(_windowHalfRevs[index] * 30000UL / _windowMillis[index]) : 0;
+}
+
+bool FanController::isSettled() {
+	if (_dutyCycle != _targetDutyCycle || _readingsSinceChange < FAN_RPM_WINDOW) {
+		return false;
+	}
+
+	unsigned long sum = 0;
+	for (byte i = 0; i < FAN_RPM_WINDOW; i++) {
+		sum += _windowRPM(i);
+	}
+	const long mean = sum / FAN_RPM_WINDOW;
+	unsigned long variance = 0;
+	for (byte i = 0; i < FAN_RPM_WINDOW; i++) {
+		const long deviation = (long)_windowRPM(i) - mean;
+		variance += (unsigned long)(deviation * deviation) / FAN_RPM_WINDOW;
+	}
+	const unsigned long limit = mean * FAN_SETTLED_PERCENT / 100;
+	return variance <= limit * limit;
+}
+
 void FanController::setDutyCycle(byte dutyCycle) {
-	hw.analogWrite(_pwmPin, 2.55 * min((int)dutyCycle, 100));
+	_targetDutyCycle = min((int)dutyCycle, 100);
+	_writeDutyCycle(_targetDutyCycle);
+}
+
+void FanController::rampDutyCycle(byte dutyCycle) {
+	if (_slewRate == 0) {
+		setDutyCycle(dutyCycle);
+		return;
+	}
+	if (_dutyCycle == _targetDutyCycle) {
+		// A new ramp is starting now.
+		_rampMillis = hw.millis();
+	}
+	_targetDutyCycle = min((int)dutyCycle, 100);
+}
+
+void FanController::_writeDutyCycle(byte dutyCycle) {
+	_dutyCycle = dutyCycle;
+	_readingsSinceChange = 0;
+	hw.setFanPWM((uint8_t)((dutyCycle * FAN_PWM_TOP + 50) / 100));
+}
+
+unsigned int FanController::getExpectedRPM(byte dutyCycle) {
+	return _interpolate(dutyCycle, &FanCurvePoint::rpm);
+}
+
+unsigned int FanController::getRPMTolerance(byte dutyCycle) {
+	return _interpolate(dutyCycle, &FanCurvePoint::toleranceRPM);
+}
+
+unsigned int FanController::getExpectedMilliWatts(byte dutyCycle) {
+	return _interpolate(dutyCycle, &FanCurvePoint::milliWatts);
+}
+
+unsigned int FanController::_interpolate(byte dutyCycle, unsigned int FanCurvePoint::* field) {
+	dutyCycle = min((int)dutyCycle, 100);
+	const int index = dutyCycle / 10;
+	const long low = _curve[index].*field;
+	if (index == FAN_CURVE_POINTS - 1) {
+		return (unsigned int)low;
+	}
+	const long high = _curve[index + 1].*field;
+	return (unsigned int)(low + ((high - low) * (dutyCycle % 10)) / 10);
+}
+
+void FanController::setCurvePoint(int index, unsigned int minRPM, unsigned int avgRPM, unsigned int maxRPM, unsigned int milliWatts) {
+	_curve[index].rpm = avgRPM;
+	_curve[index].milliWatts = milliWatts;
+	_curve[index].toleranceRPM = (maxRPM - minRPM) / 2 + (unsigned int)((avgRPM * FAN_CURVE_MARGIN_PERCENT) / 100);
+}
+
+void FanController::saveCurve() {
+	_curveJournal.write(_curve);
+}
+
+void FanController::updateHealth(byte speed) {
+	const unsigned int rpm = getRPM();
+	_addReading(_healthSums[speed], rpm);
+	_addReading(_daySums[speed], rpm);
+
+	if (++_healthSeconds >= FAN_HEALTH_READINGS_PER_HOUR) {
+		_saveHealth();
+		memset(_healthSums, 0, sizeof(_healthSums));
+		_healthSeconds = 0;
+		if (++_dayHours >= FAN_HEALTH_HOURS_PER_DAY) {
+			_saveHealthDay();
+			memset(_daySums, 0, sizeof(_daySums));
+			_dayHours = 0;
+		}
+	}
+}
+
+void FanController::_addReading(HealthSums& sums, unsigned int rpm) {
+	if (sums.count == 0 || rpm < sums.minRPM) {
+		sums.minRPM = rpm;
+	}
+	if (sums.count == 0 || rpm > sums.maxRPM) {
+		sums.maxRPM = rpm;
+	}
+	sums.count++;
+	sums.sum += rpm;
+	sums.sumOfSquares += (unsigned long)rpm * rpm;
+}
+
+// The integer square root, rounded down.
+static unsigned long squareRoot(unsigned long n) {
+	unsigned long root = 0;
+	for (unsigned long bit = 1UL << 30; bit != 0; bit >>= 2) {
+		if (n >= root + bit) {
+			n -= root + bit;
+			root = (root >> 1) + bit;
+		} else {
+			root >>= 1;
+		}
+	}
+	return root;
+}
+
+void FanController::_getStats(const HealthSums& sums, FanHealthStats& stats) {
+	if (sums.count == 0) {
+		memset(&stats, 0, sizeof(stats));
+		return;
+	}
+	const unsigned long mean = sums.sum / sums.count;
+	const unsigned long long meanOfSquares = sums.sumOfSquares / sums.count;
+	const unsigned long variance = meanOfSquares > (unsigned long long)mean * mean ? (unsigned long)(meanOfSquares - (unsigned long long)mean * mean) : 0;
+	stats.meanRPM = (unsigned int)mean;
+	stats.stdDev = (byte)min(squareRoot(variance) / FAN_HEALTH_STDDEV_UNIT, 255UL);
+	stats.belowMean = (byte)min((mean - sums.minRPM) / FAN_HEALTH_RANGE_UNIT, 255UL);
+	stats.aboveMean = (byte)min((sums.maxRPM - mean) / FAN_HEALTH_RANGE_UNIT, 255UL);
+}
+
+void FanController::_saveHealth() {
+	FanHealthRecord record;
+	record.hour = ++_healthHour;
+	for (byte i = 0; i < FAN_HEALTH_SPEEDS; i++) {
+		_getStats(_healthSums[i], record.speeds[i]);
+	}
+	_healthJournal.write(&record);
+}
+
+void FanController::_saveHealthDay() {
+	FanHealthDayRecord record;
+	record.hour = _healthHour;
+	record.hours = _dayHours;
+	for (byte i = 0; i < FAN_HEALTH_SPEEDS; i++) {
+		_getStats(_daySums[i], record.speeds[i]);
+	}
+	_healthDayJournal.write(&record);
+}
+
+static void dumpHealthStats(const char* period, unsigned int hour, const FanHealthStats* speeds) {
+	for (byte i = 0; i < FAN_HEALTH_SPEEDS; i++) {
+		const FanHealthStats& stats = speeds[i];
+		if (stats.meanRPM != 0) {
+			serialPrintf("fanHealth,%s,%u,%d,%u,%u,%u,%u", period, hour, i, stats.meanRPM, stats.stdDev * FAN_HEALTH_STDDEV_UNIT,
+				stats.meanRPM - stats.belowMean * FAN_HEALTH_RANGE_UNIT, stats.meanRPM + stats.aboveMean * FAN_HEALTH_RANGE_UNIT);
+		}
+	}
+}
+
+void FanController::dumpHealth() {
+	serialPrintf("fanHealth,period,hour,speed,meanRPM,stdDevRPM,minRPM,maxRPM");
+	FanHealthDayRecord day;
+	for (byte age = 0; getHealthDay(age, &day); age++) {
+		dumpHealthStats("day", day.hour, day.speeds);
+	}
+	FanHealthRecord record;
+	for (byte age = 0; getHealthHour(age, &record); age++) {
+		dumpHealthStats("hour", record.hour, record.speeds);
+	}
 }
 
 void FanController::_attachInterrupt() {
@@ -3,16 +3,115 @@
 */
 #pragma once
 #include "Hardware.h"
+#include "EEPROMJournal.h"
+
+// The fan curve has one point for every 10% of duty cycle, from 0% to 100%.
+const int FAN_CURVE_POINTS = 11;
+
+// The RPM is measured over a window of this many short intervals. See getRPM().
+const byte FAN_RPM_WINDOW = 4;
+
+// How many speed settings the fan health statistics are kept for. See updateHealth().
+const byte FAN_HEALTH_SPEEDS = 3;
+
+// The fan health statistics for one speed setting, over one hour or one day. To make the record small enough to
+// keep many of them in EEPROM, the spread of the readings is in units of a few RPM. A mean of 0 means the fan didn't
+// run at this speed during the hour or day.
+const unsigned int FAN_HEALTH_STDDEV_UNIT = 4;  // RPM
+const unsigned int FAN_HEALTH_RANGE_UNIT = 16;  // RPM
+struct FanHealthStats {
+	unsigned int meanRPM;
+	byte stdDev;    // the standard deviation, in FAN_HEALTH_STDDEV_UNITs
+	byte belowMean; // how far the lowest reading was below the mean, in FAN_HEALTH_RANGE_UNITs
+	byte aboveMean; // how far the highest reading was above the mean, in FAN_HEALTH_RANGE_UNITs
+};
+
+// What we save in EEPROM for each hour.
+struct FanHealthRecord {
+	unsigned int hour; // how many hours the fan has run, counting this one
+	FanHealthStats speeds[FAN_HEALTH_SPEEDS];
+};
+
+// What we save in EEPROM for each day, that is, for each FAN_HEALTH_HOURS_PER_DAY hours of running. A bearing takes
+// weeks to wear out, so these are what show the drift. The hourly records only cover the last few hours.
+const byte FAN_HEALTH_HOURS_PER_DAY = 24;
+struct FanHealthDayRecord {
+	unsigned int hour; // the "hour" of the last hour in the day
+	byte hours;        // how many hours the day covers
+	FanHealthStats speeds[FAN_HEALTH_SPEEDS];
+};
+
+// For a measured curve, the tolerance is half the measured range, plus this margin (in percent of the average)
+// to allow for changes in battery voltage, temperature, and wear. That's much tighter than the +/- 5% we have to
+// allow when we don't know anything about the particular fan.
+const unsigned long FAN_CURVE_MARGIN_PERCENT = 3;
+
+// One point of the fan curve: the RPM we expect, how far from it the actual RPM may be, and the
+// power we expect the battery to deliver with a clean filter (0 if we don't know). We keep the power rather
+// than the current, because the current at the same duty cycle goes up as the battery voltage goes down.
+struct FanCurvePoint {
+	unsigned int rpm;
+	unsigned int toleranceRPM;
+	unsigned int milliWatts;
+};
 
 class FanController : public InterruptCallback
 {
 public:
 	FanController(byte sensorPin, unsigned int sensorThreshold, byte pwmPin = 0);
 	void begin();
+
+	// Call this from loop(). It moves the duty cycle along the ramp (see rampDutyCycle), and takes RPM readings.
+	void update();
+
+	// The RPM, averaged over the last sensorThreshold milliseconds. The average is updated every
+	// sensorThreshold / FAN_RPM_WINDOW milliseconds. This works better if you call it (or update()) often.
 	unsigned int getRPM();
+
+	// Set the duty cycle right away, in percent. It's rounded to the nearest of the FAN_PWM_TOP steps (see Hardware.h).
 	void setDutyCycle(byte dutyCycle);
+
+	// Move the duty cycle gradually to a new value, at the slew rate. This limits the inrush current from the battery.
+	// The ramp progresses while you call update(). With a slew rate of 0 (the default) the duty cycle changes right away.
+	void rampDutyCycle(byte dutyCycle);
+	void setSlewRate(unsigned int percentPerSecond) { _slewRate = percentPerSecond; }
+
+	// Has the fan settled at the current duty cycle? This is true when the ramp is finished and the RPM
+	// readings over a full window have stopped changing. It says nothing about whether the RPM is correct,
+	// only that it's steady enough to be checked.
+	bool isSettled();
+
+	// The RPM we expect at a given duty cycle, how far from it the actual RPM may be, and the power we
+	// expect with a clean filter (0 if we don't know). These are interpolated from the fan curve.
+	unsigned int getExpectedRPM(byte dutyCycle);
+	unsigned int getRPMTolerance(byte dutyCycle);
+	unsigned int getExpectedMilliWatts(byte dutyCycle);
+
+	// Every fan is a bit different, so the fan curve is measured for each unit (by the Calibrator app)
+	// and saved in EEPROM. To record a curve, call setCurvePoint() for each point, with the range of RPMs
+	// and the average power, measured at that point's duty cycle, then call saveCurve(). begin() loads the curve.
+	// If no curve has been saved, we use one measured on a typical fan, which has no powers.
+	void setCurvePoint(int index, unsigned int minRPM, unsigned int avgRPM, unsigned int maxRPM, unsigned int milliWatts);
+	void saveCurve();
+
+	// Long-term fan health trending. A failing bearing shows up as the RPM slowly drifting and getting noisier.
+	// Call updateHealth() about once a second while the fan is running steadily, with the speed setting in use
+	// (0 to FAN_HEALTH_SPEEDS - 1). After each hour of running, the statistics for each speed are saved in EEPROM,
+	// where we keep the last few hours. After each day of running, the statistics for the whole day are saved too,
+	// where we keep the last few days. getHealthHour() and getHealthDay() get them, with age 0 the newest,
+	// and return false if there is no such record. dumpHealth() writes them to the serial port, so it only works
+	// in builds with SERIAL_ENABLED. In product builds, read them through the SPI port (see SPIPort.h).
+	void updateHealth(byte speed);
+	bool getHealthHour(byte age, FanHealthRecord* record) { return _healthJournal.readOlder(age, record); }
+	bool getHealthDay(byte age, FanHealthDayRecord* record) { return _healthDayJournal.readOlder(age, record); }
+	void dumpHealth();
 	
 private:
+	unsigned int _interpolate(byte dutyCycle, unsigned int FanCurvePoint::* field);
+	void _writeDutyCycle(byte dutyCycle);
+	void _saveHealth();
+	void _saveHealthDay();
+	unsigned int _windowRPM(byte index);
 	void _attachInterrupt();
 	void _detachInterrupt();
 	byte _sensorPin;
@@ -21,6 +120,34 @@ private:
 	unsigned int _lastReading;
 	volatile unsigned int _halfRevs;
 	unsigned long _lastMillis;
+	unsigned int _windowHalfRevs[FAN_RPM_WINDOW]; // the count for each interval in the window
+	unsigned int _windowMillis[FAN_RPM_WINDOW];   // the length of each interval in the window
+	byte _windowIndex;                            // where the next interval goes
+	byte _readingsSinceChange;                    // how many intervals we've measured since the duty cycle last changed
+	byte _dutyCycle;
+	byte _targetDutyCycle;
+	unsigned int _slewRate;
+	unsigned long _rampMillis;
+	FanCurvePoint _curve[FAN_CURVE_POINTS];
+	EEPROMJournal _curveJournal;
+
+	// The fan health statistics for the current hour and day, for each speed.
+	struct HealthSums {
+		unsigned long count;
+		unsigned long sum;
+		unsigned long long sumOfSquares;
+		unsigned int minRPM;
+		unsigned int maxRPM;
+	};
+	static void _addReading(HealthSums& sums, unsigned int rpm);
+	static void _getStats(const HealthSums& sums, FanHealthStats& stats);
+	HealthSums _healthSums[FAN_HEALTH_SPEEDS];
+	HealthSums _daySums[FAN_HEALTH_SPEEDS];
+	unsigned int _healthSeconds; // how many readings we've had this hour
+	unsigned int _healthHour;    // the number of the last hour we saved
+	byte _dayHours;              // how many hours we've saved this day
+	EEPROMJournal _healthJournal;
+	EEPROMJournal _healthDayJournal;
 
 public:
 	virtual void callback();
@@ -0,0 +1,57 @@
+/*
+ * FilterMonitor.cpp
+ */
+#include "FilterMonitor.h"
+#include "FanController.h"
+
+// The index is smoothed with an exponential moving average over about this many readings. With a reading
+// every second, that's about 5 minutes, so a few minutes of unusual airflow (someone covering the inlet,
+// or bending over) don't trigger a warning.
+const long FILTER_AVERAGE_DIVISOR = 300;
+
+// We warn when the index goes above FILTER_WARNING_INDEX, and stop warning when it goes below FILTER_CLEAR_INDEX.
+// With a measured fan curve, the fan alert goes off when the RPM is FAN_CURVE_MARGIN_PERCENT (3%) off, plus
+// a fraction of a percent of measured spread, so we need to warn well before that. The fan runs at a small
+// fraction of its stall torque, so a clogged filter lowers the power more than it raises the RPM, and the index
+// is at least as big as the RPM rise. Warning at two thirds of the margin (2%) leaves room for the index to
+// be averaged over 5 minutes before the RPM gets to the alert.
+const int FILTER_WARNING_INDEX = (int)(FAN_CURVE_MARGIN_PERCENT * 10 * 2 / 3); // 2%
+const int FILTER_CLEAR_INDEX = (int)(FAN_CURVE_MARGIN_PERCENT * 10 / 2);       // 1.5%
+
+FilterMonitor::FilterMonitor() :
+    indexSum(0),
+    readings(0),
+    replaceFilter(false)
+{ }
+
+void FilterMonitor::update(unsigned int rpm, unsigned int expectedRPM, long milliWatts, unsigned int expectedMilliWatts)
+{
+    if (expectedRPM == 0 || expectedMilliWatts == 0) {
+        return;
+    }
+
+    // How much faster is the fan spinning, and how much less power is it drawing? In tenths of a percent.
+    const long rpmRise = ((long)rpm - (long)expectedRPM) * 1000L / (long)expectedRPM;
+    const long powerDrop = ((long)expectedMilliWatts - milliWatts) * 1000L / (long)expectedMilliWatts;
+    const long index = (rpmRise + powerDrop) / 2;
+
+    // Until we've had enough readings for the average, use the average of the ones we have.
+    if (readings < FILTER_AVERAGE_DIVISOR) {
+        readings += 1;
+        indexSum += index * FILTER_AVERAGE_DIVISOR / readings - indexSum / readings;
+        return;
+    }
+    indexSum += index - indexSum / FILTER_AVERAGE_DIVISOR;
+
+    const int smoothed = getRestrictionIndex();
+    if (smoothed >= FILTER_WARNING_INDEX) {
+        replaceFilter = true;
+    } else if (smoothed < FILTER_CLEAR_INDEX) {
+        replaceFilter = false;
+    }
+}
+
+int FilterMonitor::getRestrictionIndex()
+{
+    return readings ? (int)(indexSum / FILTER_AVERAGE_DIVISOR) : 0;
+}
@@ -0,0 +1,34 @@
+#pragma once
+/*
+ * FilterMonitor.h
+ *
+ * The FilterMonitor estimates how clogged the filter is. As the filter loads up, less air gets through,
+ * so the fan has less work to do: at the same duty cycle it spins faster and draws less power. We compare
+ * the RPM and the power with what the Calibrator measured for this unit with a clean filter (see the fan curve
+ * in FanController.h), and average the difference over several minutes. When it gets big enough, it's time
+ * to replace the filter. This gives a warning long before the RPM is far enough off to raise a fan alert.
+ */
+
+class FilterMonitor {
+public:
+    FilterMonitor();
+
+    // Call this about once a second while the fan is running steadily, with the measured RPM and power, and
+    // the RPM and power that we expect at the same duty cycle with a clean filter. The power is the total
+    // power from the battery, so don't call this while the charger or the buzzer is on.
+    void update(unsigned int rpm, unsigned int expectedRPM, long milliWatts, unsigned int expectedMilliWatts);
+
+    // The airflow restriction index, in tenths of a percent. It's the average of how much faster the fan
+    // spins and how much less power it draws, compared to a clean filter. It's about 0 with a clean filter,
+    // and goes up as the filter clogs. Until we've collected a few minutes of readings, it's the average of
+    // the readings so far, and we don't warn.
+    int getRestrictionIndex();
+
+    // Should the user replace the filter?
+    bool shouldReplaceFilter() { return replaceFilter; }
+
+private:
+    long indexSum;          // the smoothed index, times FILTER_AVERAGE_DIVISOR
+    unsigned int readings;  // how many readings we've had, up to FILTER_AVERAGE_DIVISOR
+    bool replaceFilter;
+};
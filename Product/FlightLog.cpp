@@ -0,0 +1,43 @@
+/*
+ * FlightLog.cpp
+ */
+#include "FlightLog.h"
+#include "MySerial.h"
+
+// indexed by FlightLogEvent
+const char* FLIGHT_LOG_EVENT_NAMES[] = { "self test failed" };
+
+FlightLog::FlightLog() :
+    journal(EEPROM_FLIGHT_LOG_ADDRESS, EEPROM_FLIGHT_LOG_SIZE, sizeof(FlightLogEntry))
+{ }
+
+void FlightLog::begin()
+{
+    // We don't need the newest entry right now, but the journal needs to find it before it can write the next one.
+    FlightLogEntry entry;
+    journal.read(&entry);
+}
+
+void FlightLog::add(FlightLogEvent event, byte detail, long value)
+{
+    FlightLogEntry entry;
+    entry.event = event;
+    entry.detail = detail;
+    entry.value = value;
+    journal.write(&entry);
+}
+
+bool FlightLog::get(byte age, FlightLogEntry* entry)
+{
+    return journal.readOlder(age, entry);
+}
+
+void FlightLog::dump()
+{
+    FlightLogEntry entry;
+    for (byte age = 0; get(age, &entry); age += 1) {
+        serialPrintf("Flight log %d: %s, detail %x, value %ld", age,
+            entry.event < sizeof(FLIGHT_LOG_EVENT_NAMES) / sizeof(const char*) ? FLIGHT_LOG_EVENT_NAMES[entry.event] : "unknown",
+            entry.detail, entry.value);
+    }
+}
@@ -0,0 +1,40 @@
+#pragma once
+/*
+ * FlightLog.h
+ *
+ * The flight log keeps the last few noteworthy events in EEPROM, like an aircraft's flight recorder.
+ * When a unit comes back from the field, it tells us what went wrong with it. Writing an entry takes
+ * a few tens of milliseconds, so only log things that are rare.
+ */
+#include "EEPROMJournal.h"
+
+// The kinds of event that go in the log.
+enum FlightLogEvent { eventSelfTestFailed };
+
+// One entry in the log. The meaning of "detail" and "value" depends on the event.
+struct FlightLogEntry {
+    byte event;  // a FlightLogEvent
+    byte detail;
+    long value;
+};
+
+class FlightLog {
+public:
+    FlightLog();
+
+    // Call this once at startup, before calling any other functions.
+    void begin();
+
+    // Add an entry to the log. If the log is full, the oldest entry is lost.
+    void add(FlightLogEvent event, byte detail, long value);
+
+    // Get an entry from the log. Age 0 is the newest entry, age 1 is the one before it, and so on.
+    // Returns false if there is no such entry.
+    bool get(byte age, FlightLogEntry* entry);
+
+    // Write all the entries to the serial port, newest first.
+    void dump();
+
+private:
+    EEPROMJournal journal;
+};
@@ -2,9 +2,23 @@
  * Hardware.cpp
  */
 #include "Hardware.h"
+#include "EEPROMJournal.h"
+#include "Config.h"
+#include "CurrentIntegrator.h"
 #include <avr/interrupt.h>
 
-Hardware::Hardware() :powerOnButtonInterruptCallback(0), fanRPMInterruptCallback(0), microAmps(0) { }
+Hardware::Hardware() :powerOnButtonInterruptCallback(0), fanRPMInterruptCallback(0), spiSlaveInterruptCallback(0), pinChangeCount(0),
+    sampleTicks(0), burstStage(burstIdle),
+    havePrevCurrentSample(false), prevCurrentScaledUnits(0), currentUnitMicrosSum(0), haveVoltageSample(false),
+    currentSampleCount(0), burstsUntilBandgap(0), avccMilliVolts(NOMINAL_AVCC_MILLI_VOLTS),
+    bandgapMilliVolts(0), lastBandgapBurstSum(0), restMicroVolts(0)
+{
+    currentCalibration.offset = 0;
+    currentCalibration.gain = CURRENT_GAIN_ONE;
+    // This runs during static initialization, so we can't use setCurrentSampling(), which turns the interrupts
+    // off and on. The interrupts aren't running yet, so we can just store the setting.
+    storeCurrentSampling(fastCurrentSampling);
+}
 
 Hardware Hardware::instance;
 
@@ -35,14 +49,21 @@ void Hardware::configurePins()
     pinMode(FAN_LOW_LED_PIN, OUTPUT);
     pinMode(FAN_MED_LED_PIN, OUTPUT);
     pinMode(FAN_HIGH_LED_PIN, OUTPUT);
+    pinMode(SPI_SCK_PIN, INPUT_PULLUP);
 }
 
 // Set all devices to an initial state
 void Hardware::initializeDevices()
 {
-    // Fan on at lowest speed
+    // Fan on at lowest speed. We use Timer2 directly, instead of analogWrite(), so we can choose the PWM frequency.
+    // Timer2 runs in mode 5 (phase-correct PWM, TOP = OCR2A) with no prescaling, and OC2B (pin PD3) is
+    // cleared on compare match when up-counting, set when down-counting. See the "Timer/Counter2" chapter of the
+    // ATMega328p data sheet. Arduino only uses Timer2 for analogWrite() on pins 3 and 11, which we don't call.
     digitalWrite(FAN_ENABLE_PIN, FAN_ON);
-    analogWrite(FAN_PWM_PIN, 0); // set the fan duty cycle to 0.
+    TCCR2A = _BV(COM2B1) | _BV(WGM20);
+    TCCR2B = _BV(WGM22) | _BV(CS20);
+    OCR2A = FAN_PWM_TOP;
+    setFanPWM(0); // set the fan duty cycle to 0.
 
     // All LEDs off
     digitalWrite(BATTERY_LED_LOW_PIN, LED_OFF);
@@ -102,18 +123,423 @@ void Hardware::setClockPrescaler(int prescalerSelect)
     interrupts();
 }
 
+/********************************************************************
+ * ADC sampling
+ ********************************************************************/
+
+// Coulomb counting needs the current to be sampled at regular intervals, no matter how long each pass through
+// loop() takes. Arduino uses Timer 0 for millis(), and its overflow interrupt occurs every 2.048 milliseconds.
+// We piggyback on that timer using its "compare match B" interrupt. Every few interrupts, we start a "burst" of
+// conversions: many conversions of the current channel, the same number of the reference channel, and a few
+// of the battery voltage. The conversions are driven by the ADC's own interrupt, so the CPU is free to run
+// loop() while they're in progress. Adding up 16 conversions gives us 2 extra bits of resolution, and 64
+// gives 3 extra bits (because the noise averages out).
+//
+// Each current sample is timestamped at the start of its burst, and we add up the area of the trapezoid
+// between each pair of samples.
+//
+// Note: the ADC noise reduction sleep mode would quiet the CPU during conversions, but it also stops Timer 0,
+// which would stop both millis() and our sample clock, so we don't use it.
+//
+// A conversion takes 104 microseconds (13 ADC clocks at 125 kHz). In fast sampling, a burst of 40 conversions
+// (4.2 ms) starts every 4 ticks (8.2 ms). In precise sampling, a burst of 136 conversions (14.1 ms)
+// starts every 8 ticks (16.4 ms).
+//
+// Every BANDGAP_BURST_INTERVAL bursts, we add 16 conversions of the internal bandgap reference to the end of
+// the burst, to measure AVCC (see calibrateBandgap()). The first 8 are thrown away, because the bandgap
+// input takes a while to settle after the multiplexer switches to it. That's once every 2 to 4 seconds,
+// and even in precise sampling the longer burst (15.8 ms) still fits between ticks.
+const byte FAST_TICKS_PER_BURST = 4;
+const byte FAST_CURRENT_CONVERSIONS = 16;
+const byte PRECISE_TICKS_PER_BURST = 8;
+const byte PRECISE_CURRENT_CONVERSIONS = 64;
+
+// The ADC multiplexer settings for each pin: AVCC reference, and the pin's ADC channel.
+const byte CURRENT_ADMUX = (1 << REFS0) | (CHARGE_CURRENT_PIN - A0);
+const byte REFERENCE_ADMUX = (1 << REFS0) | (REFERENCE_VOLTAGE_PIN - A0);
+const byte VOLTAGE_ADMUX = (1 << REFS0) | (BATTERY_VOLTAGE_PIN - A0);
+const byte BANDGAP_ADMUX = (1 << REFS0) | 0x0E;
+
+const byte BANDGAP_BURST_INTERVAL = 250;
+const byte BANDGAP_SETTLE_CONVERSIONS = 8;
+const byte BANDGAP_CONVERSIONS = 8;
+
+// How many conversions of the battery voltage there are in each burst.
+const byte VOLTAGE_CONVERSIONS = 8;
+
+// The bursts already convert the current, reference and battery voltage pins, so for those pins we return the
+// average from the latest burst, rather than wait for the ADC. It's also less noisy than a single conversion.
+// For any other pin, or before the first burst, the sampling interrupts are using the ADC, so we hold them off,
+// and wait for them to finish, while we do a conversion. That can take as long as a burst (up to 15.8 ms).
+int Hardware::analogRead(uint8_t pin) {
+    long sum = 0;
+    byte count = 0;
+    noInterrupts();
+    if (pin == BATTERY_VOLTAGE_PIN && haveVoltageSample) {
+        sum = voltageBurstSum;
+        count = VOLTAGE_CONVERSIONS;
+    } else if (pin == CHARGE_CURRENT_PIN && havePrevCurrentSample) {
+        sum = lastCurrentBurstSum;
+        count = lastBurstConversions;
+    } else if (pin == REFERENCE_VOLTAGE_PIN && havePrevCurrentSample) {
+        sum = lastReferenceBurstSum;
+        count = lastBurstConversions;
+    }
+    interrupts();
+    if (count) {
+        return (int)((sum + count / 2) / count);
+    }
+
+    const uint8_t timerInterrupts = TIMSK0;
+    TIMSK0 &= ~(1 << OCIE0B);
+    while (burstStage != burstIdle) {}
+    const int reading = ::analogRead(pin);
+    TIMSK0 = timerInterrupts;
+    return reading;
+}
+
 long long Hardware::readMicroVolts() {
-    return ((long long)analogRead(BATTERY_VOLTAGE_PIN) * NANO_VOLTS_PER_VOLTAGE_UNIT) / 1000;
+    if (!haveVoltageSample) {
+        return ((long long)analogRead(BATTERY_VOLTAGE_PIN) * config.nanoVoltsPerVoltageUnit) / 1000;
+    }
+    noInterrupts();
+    const long voltageSum = voltageBurstSum;
+    interrupts();
+    return correctForAVCC(((long long)voltageSum * config.nanoVoltsPerVoltageUnit) / (1000LL * VOLTAGE_CONVERSIONS));
 }
 
 long long Hardware::readMicroAmps() {
-    long currentReading = analogRead(CHARGE_CURRENT_PIN);
-    long referenceReading = analogRead(REFERENCE_VOLTAGE_PIN);
-    long long readingMicroAmps = (((long long)(referenceReading - currentReading)) * NANO_AMPS_PER_CHARGE_FLOW_UNIT) / 1000LL;
+    // Use the latest sample from the sampling interrupts. It's already averaged over many conversions.
+    noInterrupts();
+    const long scaledUnits = prevCurrentScaledUnits;
+    interrupts();
+    return correctForAVCC(((long long)scaledUnits * config.nanoAmpsPerChargeFlowUnit) / (1000LL * CURRENT_SCALE));
+}
+
+long Hardware::readFanMilliWatts(int ledsOn) {
+    const long long fanMicroAmps = -readMicroAmps() - BOARD_IDLE_MICRO_AMPS - ledsOn * LED_MICRO_AMPS;
+    return (long)(fanMicroAmps * (readMicroVolts() / 1000LL) / 1000000LL);
+}
+
+void Hardware::startSampling()
+{
+    noInterrupts();
+    havePrevCurrentSample = false;
+    haveVoltageSample = false;
+    currentUnitMicrosSum = 0;
+    sampleTicks = 0;
+    burstsUntilBandgap = 0;
+    burstStage = burstIdle;
+    OCR0B = 128;
+    TIMSK0 |= (1 << OCIE0B);
+    interrupts();
+}
+
+// Wait until the sampling interrupts have finished a whole burst, including the voltage and (when it's due)
+// the bandgap. This takes up to 2 bursts.
+void Hardware::waitForBurst()
+{
+    const byte count = currentSampleCount;
+    while (currentSampleCount == count || burstStage != burstIdle) {}
+}
+
+void Hardware::stopSampling()
+{
+    TIMSK0 &= ~(1 << OCIE0B);
+    while (burstStage != burstIdle) {}
+}
+
+void Hardware::setCurrentSampling(CurrentSampling sampling)
+{
+    noInterrupts();
+    storeCurrentSampling(sampling);
+    interrupts();
+}
+
+void Hardware::storeCurrentSampling(CurrentSampling sampling)
+{
+    ticksPerBurst = (sampling == preciseCurrentSampling) ? PRECISE_TICKS_PER_BURST : FAST_TICKS_PER_BURST;
+    currentConversions = (sampling == preciseCurrentSampling) ? PRECISE_CURRENT_CONVERSIONS : FAST_CURRENT_CONVERSIONS;
+}
+
+// This is called by the Timer 0 interrupt. It starts a burst of conversions when it's time.
+void Hardware::onSampleTimer()
+{
+    sampleTicks += 1;
+    if (sampleTicks < ticksPerBurst || burstStage != burstIdle) {
+        return;
+    }
+    sampleTicks = 0;
+    burstMicros = micros();
+    burstCurrentConversions = currentConversions;
+    startBurstStage(burstCurrent);
+}
+
+void Hardware::startBurstStage(byte stage)
+{
+    burstStage = stage;
+    burstSum = 0;
+    switch (stage) {
+        case burstCurrent:
+            ADMUX = CURRENT_ADMUX;
+            conversionsLeft = burstCurrentConversions;
+            break;
+        case burstReference:
+            ADMUX = REFERENCE_ADMUX;
+            conversionsLeft = burstCurrentConversions;
+            break;
+        case burstVoltage:
+            ADMUX = VOLTAGE_ADMUX;
+            conversionsLeft = VOLTAGE_CONVERSIONS;
+            break;
+        default:
+            ADMUX = BANDGAP_ADMUX;
+            conversionsLeft = BANDGAP_SETTLE_CONVERSIONS + BANDGAP_CONVERSIONS;
+            break;
+    }
+    ADCSRA |= (1 << ADIE) | (1 << ADSC);
+}
+
+// This is called by the ADC interrupt, each time a conversion is complete.
+void Hardware::onConversionComplete()
+{
+    burstSum += ADC;
+    conversionsLeft -= 1;
+    if (burstStage == burstBandgap && conversionsLeft == BANDGAP_CONVERSIONS) {
+        // the bandgap has settled, so throw away the conversions so far
+        burstSum = 0;
+    }
+    if (conversionsLeft) {
+        ADCSRA |= (1 << ADSC);
+        return;
+    }
+
+    switch (burstStage) {
+        case burstCurrent:
+            currentBurstSum = burstSum;
+            startBurstStage(burstReference);
+            break;
+
+        case burstReference: {
+            // Scale the sum so that all current samples have the same scale, whatever the number of conversions.
+            // Then apply the calibration.
+            const long rawScaledUnits = scaleCurrentSample(burstSum - currentBurstSum, burstCurrentConversions);
+            const long scaledUnits = ((rawScaledUnits - currentCalibration.offset) * (long)currentCalibration.gain) / (long)CURRENT_GAIN_ONE;
+            if (havePrevCurrentSample) {
+                currentUnitMicrosSum += trapezoidScaledUnitMicros(prevCurrentScaledUnits, scaledUnits, (long)(burstMicros - prevCurrentMicros));
+            }
+            prevCurrentScaledUnits = scaledUnits;
+            prevCurrentMicros = burstMicros;
+            lastCurrentBurstSum = currentBurstSum;
+            lastReferenceBurstSum = burstSum;
+            lastBurstConversions = burstCurrentConversions;
+            havePrevCurrentSample = true;
+            currentSampleCount += 1;
+            startBurstStage(burstVoltage);
+            break;
+        }
+
+        case burstVoltage:
+            voltageBurstSum = burstSum;
+            haveVoltageSample = true;
+            if (burstsUntilBandgap == 0) {
+                burstsUntilBandgap = BANDGAP_BURST_INTERVAL;
+                startBurstStage(burstBandgap);
+                break;
+            }
+            burstsUntilBandgap -= 1;
+            ADCSRA &= ~(1 << ADIE);
+            burstStage = burstIdle;
+            break;
+
+        default: {
+            // The bandgap reading is bandgapMilliVolts * 1024 / AVCC. If we don't know this unit's bandgap,
+            // AVCC stays at NOMINAL_AVCC_MILLI_VOLTS.
+            lastBandgapBurstSum = burstSum;
+            if (bandgapMilliVolts != 0) {
+                const long avcc = ((long)bandgapMilliVolts * 1024L * BANDGAP_CONVERSIONS) / max(burstSum, 1L);
+                if (avcc >= MIN_AVCC_MILLI_VOLTS && avcc <= MAX_AVCC_MILLI_VOLTS) {
+                    avccMilliVolts = avcc;
+                }
+            }
+            ADCSRA &= ~(1 << ADIE);
+            burstStage = burstIdle;
+            break;
+        }
+    }
+}
+
+long long Hardware::takePicoCoulombs()
+{
+    noInterrupts();
+    const long long scaledUnitMicros = currentUnitMicrosSum;
+    currentUnitMicrosSum = 0;
+    interrupts();
+
+    return correctForAVCC(scaledUnitMicrosToPicoCoulombs(scaledUnitMicros, config.nanoAmpsPerChargeFlowUnit));
+}
+
+// The conversion factors assume AVCC is NOMINAL_AVCC_MILLI_VOLTS. Scale a converted reading to the measured AVCC.
+long long Hardware::correctForAVCC(long long reading)
+{
+    noInterrupts();
+    const long avcc = avccMilliVolts;
+    interrupts();
+    return (reading * avcc) / NOMINAL_AVCC_MILLI_VOLTS;
+}
+
+/********************************************************************
+ * Current sensor calibration
+ ********************************************************************/
+
+// The calibration is saved in a small journal, so that a power failure while saving can't lose it.
+EEPROMJournal currentCalibrationJournal(EEPROM_CURRENT_CALIBRATION_ADDRESS, EEPROM_CURRENT_CALIBRATION_SIZE, sizeof(CurrentCalibration));
+
+// To calibrate, we average this many samples, about a second's worth in precise sampling.
+const int CURRENT_CALIBRATION_SAMPLES = 64;
+
+// The gain calibration must come out within this range, or something was wrong with the known current.
+const unsigned int MIN_CURRENT_GAIN = CURRENT_GAIN_ONE - CURRENT_GAIN_ONE / 10;
+const unsigned int MAX_CURRENT_GAIN = CURRENT_GAIN_ONE + CURRENT_GAIN_ONE / 10;
+
+bool Hardware::loadCurrentCalibration()
+{
+    CurrentCalibration saved;
+    if (!currentCalibrationJournal.read(&saved)) {
+        return false;
+    }
+    noInterrupts();
+    currentCalibration = saved;
+    interrupts();
+    return true;
+}
+
+void Hardware::setCurrentCalibration(const CurrentCalibration& calibration)
+{
+    noInterrupts();
+    currentCalibration = calibration;
+    interrupts();
+    currentCalibrationJournal.write(&calibration);
+}
+
+// Average the current samples, with the given offset and a gain of 1, using precise sampling.
+long Hardware::measureCurrentScaledUnits(int offset)
+{
+    const CurrentCalibration saved = currentCalibration;
+    noInterrupts();
+    currentCalibration.offset = offset;
+    currentCalibration.gain = CURRENT_GAIN_ONE;
+    interrupts();
+    setCurrentSampling(preciseCurrentSampling);
+
+    // Throw away the sample that may have started before we changed the settings.
+    waitForBurst();
+    long sum = 0;
+    for (int i = 0; i < CURRENT_CALIBRATION_SAMPLES; i += 1) {
+        waitForBurst();
+        noInterrupts();
+        sum += prevCurrentScaledUnits;
+        interrupts();
+    }
+
+    noInterrupts();
+    currentCalibration = saved;
+    interrupts();
+    return sum / CURRENT_CALIBRATION_SAMPLES;
+}
 
-    const long long lowPassFilterN = 10LL;
-    microAmps = ((microAmps * lowPassFilterN) + readingMicroAmps) / (lowPassFilterN + 1);
-    return microAmps;
+// The scaled readings are converted to microamps by readMicroAmps(). This is the reverse.
+static long microAmpsToScaledUnits(long long microAmps, long avccMilliVolts)
+{
+    return (long)((microAmps * 1000LL * CURRENT_SCALE * NOMINAL_AVCC_MILLI_VOLTS) / (config.nanoAmpsPerChargeFlowUnit * avccMilliVolts));
+}
+
+void Hardware::calibrateCurrentZero()
+{
+    for (int i = 0; i < numLEDs; i += 1) {
+        digitalWrite(LEDpins[i], LED_OFF);
+    }
+    CurrentCalibration calibration = currentCalibration;
+    const long idleScaledUnits = microAmpsToScaledUnits(-BOARD_IDLE_MICRO_AMPS, avccMilliVolts);
+    calibration.offset = (int)(measureCurrentScaledUnits(0) - idleScaledUnits);
+    setCurrentCalibration(calibration);
+}
+
+bool Hardware::calibrateCurrentGain(long long knownMicroAmps)
+{
+    const long measuredScaledUnits = measureCurrentScaledUnits(currentCalibration.offset);
+    const long knownScaledUnits = microAmpsToScaledUnits(knownMicroAmps, avccMilliVolts);
+    if (measuredScaledUnits == 0) {
+        return false;
+    }
+    const long long gain = ((long long)knownScaledUnits * CURRENT_GAIN_ONE) / measuredScaledUnits;
+    if (gain < MIN_CURRENT_GAIN || gain > MAX_CURRENT_GAIN) {
+        return false;
+    }
+    CurrentCalibration calibration = currentCalibration;
+    calibration.gain = (unsigned int)gain;
+    setCurrentCalibration(calibration);
+    return true;
+}
+
+/********************************************************************
+ * Bandgap calibration
+ ********************************************************************/
+
+EEPROMJournal bandgapCalibrationJournal(EEPROM_BANDGAP_CALIBRATION_ADDRESS, EEPROM_BANDGAP_CALIBRATION_SIZE, sizeof(unsigned int));
+
+// To calibrate, we average this many bandgap measurements.
+const int BANDGAP_CALIBRATION_MEASUREMENTS = 4;
+
+void Hardware::loadBandgapCalibration()
+{
+    unsigned int saved;
+    if (bandgapCalibrationJournal.read(&saved) && saved >= MIN_BANDGAP_MILLI_VOLTS && saved <= MAX_BANDGAP_MILLI_VOLTS) {
+        noInterrupts();
+        bandgapMilliVolts = saved;
+        interrupts();
+    }
+}
+
+bool Hardware::calibrateBandgap(long knownAVCCMilliVolts)
+{
+    long sum = 0;
+    for (int i = 0; i < BANDGAP_CALIBRATION_MEASUREMENTS; i += 1) {
+        // Ask for a bandgap measurement at the end of the next burst, and wait until a whole burst has gone by.
+        noInterrupts();
+        burstsUntilBandgap = 0;
+        interrupts();
+        waitForBurst();
+        waitForBurst();
+        noInterrupts();
+        sum += lastBandgapBurstSum;
+        interrupts();
+    }
+
+    // The bandgap reading is bandgap * 1024 / AVCC.
+    const long bandgap = (knownAVCCMilliVolts * sum) / (1024L * BANDGAP_CONVERSIONS * BANDGAP_CALIBRATION_MEASUREMENTS);
+    if (bandgap < MIN_BANDGAP_MILLI_VOLTS || bandgap > MAX_BANDGAP_MILLI_VOLTS) {
+        return false;
+    }
+    const unsigned int calibration = (unsigned int)bandgap;
+    noInterrupts();
+    bandgapMilliVolts = calibration;
+    avccMilliVolts = knownAVCCMilliVolts;
+    interrupts();
+    bandgapCalibrationJournal.write(&calibration);
+    return true;
+}
+
+// The Timer 0 compare match B interrupt vector points to this code.
+ISR(TIMER0_COMPB_vect)
+{
+    Hardware::instance.onSampleTimer();
+}
+
+// The ADC conversion complete interrupt vector points to this code.
+ISR(ADC_vect)
+{
+    Hardware::instance.onConversionComplete();
 }
 
 void Hardware::reset()
@@ -124,6 +550,8 @@ void Hardware::reset()
 }
 
 void Hardware::handleInterrupt() {
+    pinChangeCount += 1;
+
     if (powerOnButtonInterruptCallback) {
         // A callback has been registered for the Power On Button interrupt. 
         // Only call it if the button state has changed.
@@ -189,6 +617,48 @@ void Hardware::setFanRPMInterruptCallback(InterruptCallback* callback)
     updateInterruptHandling();
 }
 
+// The SPI runs in slave mode 0 (SCK idles low, data is sampled on the rising edge), most significant bit first.
+// In slave mode the SPI only listens while SS (PB2) is low. PB2 is the buzzer output, but when it's an input,
+// the buzzer driver holds it low, so the SPI is always listening. Make sure PB2's pullup is off.
+// See the "SPI - Serial Peripheral Interface" chapter of the ATMega328p data sheet.
+void Hardware::setSPISlaveInterruptCallback(InterruptCallback* callback)
+{
+    noInterrupts();
+    spiSlaveInterruptCallback = callback;
+    if (callback) {
+        PORTB &= ~(1 << PB2); // not digitalWrite(), which would also stop the buzzer's PWM
+        pinMode(SPI_MISO_PIN, OUTPUT);
+        SPCR = _BV(SPIE) | _BV(SPE);
+    } else {
+        SPCR = 0;
+        pinMode(SPI_MISO_PIN, INPUT);
+    }
+    interrupts();
+}
+
+// The SPI serial transfer complete interrupt vector points to this code.
+ISR(SPI_STC_vect)
+{
+    Hardware::instance.onSPITransferComplete();
+}
+
+// These are Arduino's millisecond counter, and the count of Timer 0 overflows that micros() is based on.
+// The Timer 0 interrupt updates both.
+extern volatile unsigned long timer0_millis;
+extern volatile unsigned long timer0_overflow_count;
+
+// Timer 0 overflows every 64 * 256 clock cycles, which is 2048 microseconds at 8 MHz.
+const unsigned long MICROS_PER_TIMER0_OVERFLOW = 64UL * 256UL / (F_CPU / 1000000UL);
+
+void Hardware::addMillis(unsigned long sleptMillis)
+{
+    const unsigned long overflows = (unsigned long)((unsigned long long)sleptMillis * 1000ULL / MICROS_PER_TIMER0_OVERFLOW);
+    noInterrupts();
+    timer0_millis += sleptMillis;
+    timer0_overflow_count += overflows;
+    interrupts();
+}
+
 void Hardware::setPowerMode(PowerMode mode)
 {
     if (mode == fullPowerMode) {
@@ -204,7 +674,11 @@ void Hardware::setPowerMode(PowerMode mode)
         setClockPrescaler(0);
 
         // We are now running at full power, full speed.
+        startSampling();
     } else {
+        // The ADC readings are meaningless in low power mode.
+        stopSampling();
+
         // Full speed doesn't work in low power mode, so drop the MCU clock speed to 1 MHz (8 MHz internal oscillator divided by 2**3). 
         setClockPrescaler(3);
 
@@ -221,13 +695,35 @@ void Hardware::setPowerMode(PowerMode mode)
     powerMode = mode;
 }
 
-void Hardware::setup() {
+void Hardware::setup(bool autoZeroCurrent) {
+    // Load the bandgap calibration before the sampling starts, so the first burst can measure AVCC with it.
+    loadBandgapCalibration();
+
     // If the power has just come on, then the PCB is in Low Power mode, and the MCU
     // is running at 1 MHz (because the CKDIV8 fuse bit is programmed). Switch to full speed.
     setPowerMode(fullPowerMode);
 
-    // Initialize the hardware
+    // Initialize the hardware. The fan enable pin is low until initializeDevices() turns the fan on,
+    // so this is our chance to measure the battery voltage with (almost) no load. We average several
+    // bursts to reduce the noise. The first burst after startSampling() also measures AVCC (if the bandgap has
+    // been calibrated), so by the time we correct the voltage for AVCC, we know what it is.
     configurePins();
+    const int restVoltageBursts = 4;
+    long long voltageSum = 0;
+    for (int i = 0; i < restVoltageBursts; i += 1) {
+        waitForBurst();
+        noInterrupts();
+        voltageSum += voltageBurstSum;
+        interrupts();
+    }
+    restMicroVolts = correctForAVCC((voltageSum * config.nanoVoltsPerVoltageUnit) / (1000LL * VOLTAGE_CONVERSIONS * restVoltageBursts));
+
+    // If the current sensor has never been calibrated, this is a good time to find its zero point, unless
+    // the charger is connected. The fan is disabled, and calibrateCurrentZero() turns off the LEDs,
+    // so the only current is the board's own.
+    if (!loadCurrentCalibration() && autoZeroCurrent && digitalRead(CHARGER_CONNECTED_PIN) != CHARGER_CONNECTED) {
+        calibrateCurrentZero();
+    }
     initializeDevices();
 }
 
@@ -14,6 +14,7 @@
 #else
 #include "Arduino.h"
 #include <avr/wdt.h> 
+#include <avr/eeprom.h>
 #endif
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -38,6 +39,8 @@ enum PowerMode { lowPowerMode, fullPowerMode };
 
 // On startup, the PCB initializes itself to the low power mode. Also, CLKDIV8 in the MCU's low fuse byte
 // initializes the MCU clock divider to 2**3, which results in MCU clock of 1 MHz.
+// We use the same divider whenever we're in low power mode, so millis() runs this many times too slow.
+const unsigned long LOW_POWER_CLOCK_DIVISOR = 8;
 
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -61,6 +64,16 @@ const int FAN_ENABLE_PIN = 98;        // PB6   output  Digital: LOW = fan off, H
 const int FAN_ON = HIGH;
 const int FAN_OFF = LOW;
 
+// The fan PWM is generated by Timer2 in phase-correct mode, with OCR2A as TOP, so the frequency is
+// F_CPU / (2 * FAN_PWM_TOP). 4-wire fans expect about 25 kHz, which is above hearing range. The duty cycle
+// has FAN_PWM_TOP steps. FAN_PWM_TOP must be at most 255.
+//
+// At 8 MHz that's 160 steps, about 0.63% each. With analogWrite() there were 255 steps, so the resolution of the
+// PWM itself is lower than it was. FanController still works in whole percent, and each percent still gets its
+// own step, but a percent can now be up to 0.31% off instead of 0.2%. Use setFanPWM() if you need every step.
+const long FAN_PWM_FREQUENCY_HZ = 25000;
+const unsigned int FAN_PWM_TOP = F_CPU / (2 * FAN_PWM_FREQUENCY_HZ);
+
 // Power
 const int BATTERY_VOLTAGE_PIN = A7;   // ADC7  input   10-bit ADC: convert to volts using NANO_VOLTS_PER_VOLTAGE_UNIT
 const int CHARGE_CURRENT_PIN = A6;    // ADC6  input   10-bit ADC: convert to amps using MICRO_AMPS_PER_CHARGE_FLOW_UNIT
@@ -99,12 +112,28 @@ const byte LEDpins[] = {
 };
 const int numLEDs = sizeof(LEDpins) / sizeof(byte);
 
+// Bit masks for sets of LEDs. Bit i corresponds to LEDpins[i].
+const byte BATTERY_LED_LOW_MASK  = 1 << 0;
+const byte BATTERY_LED_MED_MASK  = 1 << 1;
+const byte BATTERY_LED_HIGH_MASK = 1 << 2;
+const byte CHARGING_LED_MASK     = 1 << 3;
+const byte FAN_LOW_LED_MASK      = 1 << 4;
+const byte FAN_MED_LED_MASK      = 1 << 5;
+const byte FAN_HIGH_LED_MASK     = 1 << 6;
+const byte ALL_LEDS_MASK         = (1 << numLEDs) - 1;
+
 // Serial port - these definitions are assumed by the Arduino "Serial" object.                    
 const int SERIAL_RX_PIN = 0;          // PD0   input   Cannot be used by Serial, because it's also CHARGER_CONNECTED_PIN.
 const int SERIAL_TX_PIN = 1;          // PD1   output  Can be used by Serial, usually only on development machines
 
+// SPI port, on the 6-pin ISP header. While the power is off, a host can hold SCK low and unlock the port, and the
+// firmware becomes an SPI slave. See SPIPort.h.
+const int SPI_MOSI_PIN = 11;          // PB3   input
+const int SPI_MISO_PIN = 12;          // PB4   output while the SPI slave is on, otherwise input
+const int SPI_SCK_PIN = 13;           // PB5   input   Digital: LOW = a host is connected, HIGH = no host. Requires pullup.
+
 // FYI, here are some MCU pins that are used by the PCB, but we don't access from the firmware.
-// SPI PORT: MOSI = PB3, MISO = PB4, SCLK = PB5, RESET = PC6
+// RESET = PC6
 // Power: VCC, AVCC, GND
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -114,10 +143,27 @@ const int SERIAL_TX_PIN = 1;          // PD1   output  Can be used by Serial, us
 ////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 // "long long" has 18-19 decimal digits of precision. Watch out for overflow!
+// These are only the defaults: the firmware uses the values in Config, which a unit can override in EEPROM.
 const long long NANO_AMPS_PER_CHARGE_FLOW_UNIT = 6516781LL;
 const long long NANO_VOLTS_PER_VOLTAGE_UNIT = 29325513LL;             // 0 to 1023 corresponds to 0 to 30 volts
-const long long BATTERY_CAPACITY_PICO_COULOMBS = 25200000000000000LL; // 25,200 coulombs // TODO fudge factor? probably 0.8
+const long long BATTERY_CAPACITY_PICO_COULOMBS = 25200000000000000LL; // 25,200 coulombs. The nominal capacity; Battery learns the real capacity of each pack.
 const long long BATTERY_MIN_CHARGE_PICO_COULOMBS = 2100000000000000LL; // 2,100 coulombs the minimum charge level // TODO fudge factor? probably 0.8
+const long BATTERY_RESISTANCE_MILLI_OHMS = 200L; // The pack's internal resistance plus the wiring. Under load, the voltage we read is this much times the current below the rest voltage.
+const long long BOARD_IDLE_MICRO_AMPS = 12000LL; // What the board itself draws at full power, with the fan disabled and the LEDs and buzzer off.
+const long long LED_MICRO_AMPS = 2000LL; // Approximately what each lit LED adds to that.
+const long long BATTERY_SLEEP_MICRO_AMPS = 200LL; // Average drain while napping, including self-discharge. Matches the observed loss of about 2% per month.
+
+// The conversion factors above assume that the ADC reference, AVCC, is exactly 5 volts. The 5V regulator is only
+// accurate to +/- 2% (see the note below), so Hardware measures the MCU's internal bandgap reference every few seconds
+// to find the real AVCC, and corrects the readings. The datasheet only promises that the bandgap is between 1.0
+// and 1.2 volts, which is much worse than the regulator, but it's very stable for any one chip. So the Calibrator
+// measures each unit's bandgap (see Hardware::calibrateBandgap()), and until a unit has been calibrated,
+// we don't correct for AVCC at all.
+const long NOMINAL_AVCC_MILLI_VOLTS = 5000L;
+const long MIN_BANDGAP_MILLI_VOLTS = 1000L;
+const long MAX_BANDGAP_MILLI_VOLTS = 1200L;
+const long MIN_AVCC_MILLI_VOLTS = 4500L; // AVCC measurements outside this range are ignored
+const long MAX_AVCC_MILLI_VOLTS = 5500L;
 
 /*
 Here is a note from Brent Bolton about how AMPS_PER_CHARGE_FLOW_UNIT and VOLTS_PER_VOLTAGE_UNIT are determined:
@@ -158,6 +204,37 @@ The final equation therefore is
 Current_in_mA = (ADC6 - PC1) * 6.516780710329097
 */
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// EEPROM layout
+//
+////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// The MCU has 1024 bytes of EEPROM, which keep their values when the power is off. Each byte can
+// be written about 100,000 times before it wears out. Here is how we divide up the EEPROM.
+const int EEPROM_FLIGHT_LOG_ADDRESS = 0; // Noteworthy events, see FlightLog.cpp
+const int EEPROM_FLIGHT_LOG_SIZE = 80;
+const int EEPROM_FAN_HEALTH_ADDRESS = 80; // Hourly fan statistics, see FanController.cpp
+const int EEPROM_FAN_HEALTH_SIZE = 84;
+const int EEPROM_FAN_HEALTH_DAYS_ADDRESS = 164; // Daily fan statistics, see FanController.cpp
+const int EEPROM_FAN_HEALTH_DAYS_SIZE = 168;
+const int EEPROM_USAGE_COUNTERS_ADDRESS = 332; // Lifetime usage statistics, see UsageCounters.cpp
+const int EEPROM_USAGE_COUNTERS_SIZE = 112;
+const int EEPROM_CONFIG_ADDRESS = 444; // Settings that override the defaults, see Config.cpp
+const int EEPROM_CONFIG_SIZE = 68;
+const int EEPROM_BATTERY_JOURNAL_ADDRESS = 512; // The battery's coulomb count, see Battery.cpp
+const int EEPROM_BATTERY_JOURNAL_SIZE = 256;
+const int EEPROM_BATTERY_CAPACITY_ADDRESS = 768; // The battery's learned capacity, see Battery.cpp
+const int EEPROM_BATTERY_CAPACITY_SIZE = 48;
+const int EEPROM_CURRENT_CALIBRATION_ADDRESS = 816; // The current sensor calibration, see Hardware.cpp
+const int EEPROM_CURRENT_CALIBRATION_SIZE = 24;
+const int EEPROM_BANDGAP_CALIBRATION_ADDRESS = 840; // The bandgap reference's measured voltage, see Hardware.cpp
+const int EEPROM_BANDGAP_CALIBRATION_SIZE = 16;
+const int EEPROM_FAN_CURVE_ADDRESS = 856; // The fan's measured RPM curve, see FanController.cpp
+const int EEPROM_FAN_CURVE_SIZE = 140;
+const int EEPROM_RESET_COUNTS_ADDRESS = 996; // The usage counters' reset counts, see UsageCounters.cpp
+const int EEPROM_RESET_COUNTS_SIZE = 28;
+
 // The MCU's fuse bytes should be set as follows
 //   low fuse byte 0x72
 //   high fuse byte 0xDA
@@ -169,6 +246,16 @@ public:
     virtual void callback() = 0;
 };
 
+// See Hardware::setCurrentSampling()
+enum CurrentSampling { fastCurrentSampling, preciseCurrentSampling };
+
+// The per-unit calibration of the current sensor. See Hardware::calibrateCurrentZero().
+const unsigned int CURRENT_GAIN_ONE = 16384; // a gain of 1.0
+struct CurrentCalibration {
+    int offset;        // the reading when no current is flowing, in ADC units times 64
+    unsigned int gain; // multiply the reading by gain / CURRENT_GAIN_ONE
+};
+
 // This singleton class provides hardware-specific functions.
 class Hardware {
 public:
@@ -183,8 +270,9 @@ public:
     inline void pinMode(uint8_t pin, uint8_t mode) { ::pinMode(pin, mode); }
     void digitalWrite(uint8_t pin, uint8_t val);
     inline int digitalRead(uint8_t pin) { return ::digitalRead(pin); }
-    inline int analogRead(uint8_t pin) { return ::analogRead(pin); }
+    int analogRead(uint8_t pin); // for the pins that the sampling interrupts convert, the latest burst average, without waiting
     inline void analogWrite(uint8_t pin, int val) { ::analogWrite(pin, val); }
+    inline void setFanPWM(uint8_t compare) { OCR2B = compare; } // 0 = always low, FAN_PWM_TOP = always high
     inline unsigned long millis(void) { return ::millis(); }
     inline unsigned long micros(void) { return ::micros(); }
     inline void delay(unsigned long ms) { ::delay(ms); }
@@ -192,6 +280,10 @@ public:
     inline void wdt_enable(const uint8_t value) { ::wdt_enable(value); }
     inline void wdt_disable() { ::wdt_disable(); }
     inline void wdt_reset_() { wdt_reset(); } // wdt_reset is a macro so we can't use "::"
+    inline void readEEPROM(int address, void* buffer, int size) { eeprom_read_block(buffer, (const void*)address, size); }
+    inline void writeEEPROM(int address, const void* buffer, int size) { eeprom_update_block(buffer, (void*)address, size); }
+    inline byte readSPIData() { return SPDR; }
+    inline void writeSPIData(byte data) { SPDR = data; }
 
     ////////////////////////////////////////////////////////////////////////////////////////////////////////
     //
@@ -213,23 +305,93 @@ public:
     // Register a callback for an interrupt whenever the fan RPM input toggles.
     void setFanRPMInterruptCallback(InterruptCallback*);
 
-    // Call this function right after calling watchdogStartup()
-    void setup();
+    // Turn on the SPI slave, and register a callback for an interrupt whenever it has received a byte.
+    // Call readSPIData() to get the byte, and writeSPIData() to set the byte that the host will get next.
+    // While the SPI slave is on, the hardware makes BUZZER_PIN (PB2, which is also the SPI's SS pin) an input,
+    // so the buzzer is silent. Pass 0 to turn the SPI slave off.
+    void setSPISlaveInterruptCallback(InterruptCallback*);
+
+    // Call this function right after calling watchdogStartup(). If the current sensor has never been
+    // calibrated, and autoZeroCurrent is true, this also finds the sensor's zero point (see calibrateCurrentZero()).
+    void setup(bool autoZeroCurrent = true);
 
     // Set/Get the current power mode.
     void setPowerMode(PowerMode mode);
     PowerMode getPowerMode() { return powerMode; }
 
+    // The millis() and micros() clocks stop while the MCU is sleeping. After sleeping, call this to move the
+    // clocks forward by the amount of time we slept.
+    void addMillis(unsigned long sleptMillis);
+
     // This function handles various interrupts
     void handleInterrupt();
 
+    // How many pin change interrupts there have been, modulo 256. If this changes while the MCU is sleeping,
+    // a pin change woke it up.
+    byte getPinChangeCount() { return pinChangeCount; }
+
     // Read the battery/charger voltage. Result is microvolts in the range 0 to 30,000,000
     long long readMicroVolts();
 
+    // The battery voltage that setup() measured before turning on the fan. Because almost no current was
+    // flowing, this is close to the battery's open-circuit voltage.
+    long long readRestMicroVolts() { return restMicroVolts; }
+
     // Read the battery current in microamperes in the range -6,000,000 to +6,000,000.
     // The value is positive when charging, negative when discharging.
     long long readMicroAmps();
 
+    // The power going to the fan, in milliwatts: the battery power, less what the board itself and the
+    // given number of lit LEDs draw. Only meaningful while discharging with the buzzer off. The fan curve
+    // and the filter monitor both use this, so that the LEDs that happen to be on don't skew the comparison.
+    long readFanMilliWatts(int ledsOn);
+
+    // In full power mode, interrupts sample the battery current at a fixed rate and integrate it using
+    // the trapezoidal rule. This returns the charge that has flowed since the last call, in picoCoulombs.
+    // The value is positive when charging, negative when discharging.
+    long long takePicoCoulombs();
+
+    // Choose between fast current sampling (more samples per second, less resolution) and
+    // precise current sampling (fewer samples per second, more resolution).
+    void setCurrentSampling(CurrentSampling sampling);
+
+    // The current sensor's reference (PC1) doesn't exactly balance the sense amplifier, so each board reads a
+    // small current even when no current is flowing. This function measures that reading and saves the zero point
+    // in EEPROM. Before calling it, make sure that the only current flowing is the board's own: the fan must be
+    // disabled, and the charger must be disconnected. The function turns off the LEDs, so that the board draws
+    // BOARD_IDLE_MICRO_AMPS, and sets the zero point so that that's what we read. It takes about a second.
+    void calibrateCurrentZero();
+
+    // Measure the current sensor's gain against a known current, and save it in EEPROM. Call this after
+    // calibrateCurrentZero(), with exactly knownMicroAmps flowing (negative for a discharge, and including the
+    // board's own current). Returns false, and leaves the gain alone, if the gain comes out more than
+    // 10% away from 1, because then the current wasn't what the caller thought. It takes about a second.
+    bool calibrateCurrentGain(long long knownMicroAmps);
+
+    // Get/set the current sensor calibration. Setting it also saves it in EEPROM.
+    CurrentCalibration getCurrentCalibration() { return currentCalibration; }
+    void setCurrentCalibration(const CurrentCalibration& calibration);
+
+    // Measure this unit's bandgap reference against a known AVCC, and save it in EEPROM. From then on, the readings
+    // are corrected for AVCC. Call this with AVCC held at exactly avccMilliVolts. Returns false, and leaves the
+    // calibration alone, if the bandgap comes out outside the datasheet's range. It takes about 50 milliseconds.
+    bool calibrateBandgap(long avccMilliVolts);
+
+    // This unit's bandgap reference, in millivolts, or 0 if it hasn't been calibrated.
+    unsigned int getBandgapMilliVolts() { return bandgapMilliVolts; }
+
+    // The ADC reference voltage (AVCC), as measured against the bandgap reference. The readings
+    // from readMicroVolts(), readMicroAmps(), and takePicoCoulombs() are already corrected for this.
+    // If the bandgap hasn't been calibrated, this is NOMINAL_AVCC_MILLI_VOLTS.
+    long getAVCCMilliVolts() { return avccMilliVolts; }
+
+    // These are called by the sampling interrupts. Don't call them yourself.
+    void onSampleTimer();
+    void onConversionComplete();
+
+    // This is called by the SPI interrupt. Don't call it yourself.
+    void onSPITransferComplete() { spiSlaveInterruptCallback->callback(); }
+
     // There can only be one instance of this object.
     static Hardware instance;
 
@@ -239,10 +401,48 @@ private:
     unsigned int fanRPMState;
     InterruptCallback* powerOnButtonInterruptCallback;
     InterruptCallback* fanRPMInterruptCallback;
+    InterruptCallback* spiSlaveInterruptCallback;
+    volatile byte pinChangeCount; // how many pin change interrupts there have been, modulo 256
     void updateInterruptHandling();
  
     PowerMode powerMode; // which mode are we currently in?
-    long long microAmps; // we use this to help smooth battery current readings.
+
+    // Data for ADC sampling. Most of these are updated by the sampling interrupts.
+    enum BurstStage { burstCurrent, burstReference, burstVoltage, burstBandgap, burstIdle };
+    byte sampleTicks;                          // counts timer interrupts until the next burst
+    byte ticksPerBurst;                        // how many timer interrupts there are between bursts
+    byte currentConversions;                   // how many conversions of the current and reference channels to do in each burst
+    byte burstCurrentConversions;              // the value of currentConversions when this burst started
+    volatile byte burstStage;                  // a BurstStage: which channel the ADC is converting
+    byte conversionsLeft;                      // how many more conversions to do on this channel
+    long burstSum;                             // the sum of the conversions on this channel so far
+    long currentBurstSum;                      // the sum of the current channel conversions in this burst
+    unsigned long burstMicros;                 // micros() timestamp of the start of this burst
+    volatile bool havePrevCurrentSample;       // do we have a previous sample to integrate from?
+    volatile long prevCurrentScaledUnits;      // the previous sample, in ADC units times CURRENT_SCALE
+    unsigned long prevCurrentMicros;           // micros() timestamp of the previous sample
+    volatile long long currentUnitMicrosSum;   // twice the integral of the samples since the last takePicoCoulombs(), in scaled ADC unit-microseconds
+    volatile long lastCurrentBurstSum;         // the sum of the current channel conversions in the last complete burst
+    volatile long lastReferenceBurstSum;       // the sum of the reference channel conversions in the last complete burst
+    volatile byte lastBurstConversions;        // how many conversions of each are in those sums
+    volatile bool haveVoltageSample;           // has voltageBurstSum been set yet?
+    volatile long voltageBurstSum;             // the sum of the voltage conversions in the last burst
+    volatile byte currentSampleCount;          // goes up by 1 for each current sample
+    CurrentCalibration currentCalibration;     // applied to each current sample
+    bool loadCurrentCalibration();
+    long measureCurrentScaledUnits(int offset);
+    byte burstsUntilBandgap;                   // how many more bursts until we measure the bandgap again
+    volatile long avccMilliVolts;              // the measured AVCC
+    volatile unsigned int bandgapMilliVolts;   // this unit's bandgap reference, or 0 if we don't know it
+    volatile long lastBandgapBurstSum;         // the sum of the bandgap conversions in the last bandgap burst
+    void loadBandgapCalibration();
+    long long correctForAVCC(long long reading);
+    void startSampling();
+    void stopSampling();
+    void startBurstStage(byte stage);
+    void storeCurrentSampling(CurrentSampling sampling);
+    void waitForBurst();
+    long long restMicroVolts; // the battery voltage before the fan was turned on
 
     // initialization
     Hardware();
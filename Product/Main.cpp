@@ -16,6 +16,8 @@
 #include <LowPower.h>
 #include "MySerial.h"
 #include "Hardware.h"
+#include "Checksum.h"
+#include "Config.h"
 
  // The Hardware object gives access to all the microcontroller hardware such as pins and timers. Please always use this object,
  // and never access any hardware or Arduino APIs directly. This gives us the option of using a fake hardware object for unit testing.
@@ -27,6 +29,24 @@ const char* STATE_NAMES[] = { "Off", "On", "Off Charging", "On Charging" };
 // TODO make this automatically update during build process
 const char* PRODUCT_ID = "PAPR Rev 3.1 6/20/2021";
 
+/********************************************************************
+ * Resume data
+ ********************************************************************/
+
+// A snapshot of everything the user can perceive, so that after a watchdog or brown-out reset we can carry on
+// where we left off, instead of dropping the fan to its default speed and re-estimating the battery charge.
+// It lives in the ".noinit" memory section, which the C runtime doesn't clear on startup, so it survives
+// any reset where the MCU doesn't lose power. After a power-on reset it contains garbage, which the checksum detects.
+struct ResumeSnapshot {
+    byte paprState;       // a PAPRState
+    byte fanSpeed;        // a FanSpeed
+    byte alerts;          // bit (1 << Alert) for each active alert
+    bool chargeIsCalibrated;
+    long long picoCoulombs;
+    uint16_t checksum;    // covers all the fields above
+};
+ResumeSnapshot resumeSnapshot __attribute__((section(".noinit")));
+
 /********************************************************************
  * Fan constants
  ********************************************************************/
@@ -38,74 +58,105 @@ const int FAN_SPEED_READING_INTERVAL = 1000;
 // The duty cycle for each fan speed. Indexed by FanSpeed.
 const byte fanDutyCycles[] = { 0, 50, 100 };
 
-// The expected RPM for each fan speed. Indexed by FanSpeed.
-const unsigned int expectedFanRPM[] = { 7479, 16112, 22271 };
-/* Here are measured values for fan RMP for the San Ace 9GA0412P3K011
-   %    MIN     MAX     AVG
-
-   0,    7461,   7480,    7479
-  10,    9431,   9481,    9456
-  20,   11264,  11284,   11274
-  30,   12908,  12947,   12928
-  40,   14580,  14626,   14603
-  50,   16047,  16177,   16112
-  60,   17682,  17743,   17743
-  70,   19092,  19150,   19121
-  80,   20408,  20488,   20448
-  90,   21510,  21556,   21533
- 100,   22215,  22327,   22271 
-*/
-
-// How much tolerance do we give when checking for correct fan RPM. We allow +/- 5%.
-const float LOWEST_FAN_OK_RPM = 0.95;
-const float HIGHEST_FAN_OK_RPM = 1.05;
+// The expected RPM for each duty cycle, and how far from it the fan may be, come from the FanController's fan curve.
 
 // The fan speed when we startup.
 const FanSpeed DEFAULT_FAN_SPEED = fanLow;
 
-// When we change the fan speed, allow at least this many milliseconds before checking the speed.
-// This gives the fan enough time to stabilize at the new speed.
-const int FAN_STABILIZE_MILLIS = 6000;
+// How fast the fan speed ramps, and how long it may take to settle, are in Config.
+
+// While napping, we sleep this many milliseconds at a time (SLEEP_1S), then check the buttons and the charger.
+const unsigned long NAP_SLEEP_MILLIS = 1000;
 
 /********************************************************************
- * Button constants
+ * Self-test constants
  ********************************************************************/
 
-// The user must push a button for at least this many milliseconds.
-const int BUTTON_DEBOUNCE_MILLIS = 1000;
-
-// The power off button needs a very short debounce interval,
-// so it can do a little song and dance before taking effect.
-const int POWER_OFF_BUTTON_DEBOUNCE_MILLIS = 50;
-
-// The power off button only takes effect if the user holds it pressed for at least this long.
-const int POWER_OFF_BUTTON_HOLD_MILLIS = 1000;
-
+// The power-on self-test must be finished this many milliseconds after setup() starts. This allows for
+// a couple of fan RPM readings.
+const unsigned long SELF_TEST_DEADLINE_MILLIS = 2500;
+
+// Readings outside these ranges mean there's something wrong with the board.
+const long long SELF_TEST_MIN_MICRO_VOLTS = 10000000LL; // well below an empty battery
+const long long SELF_TEST_MAX_MICRO_VOLTS = 27000000LL; // well above a full battery, or the charger
+const int SELF_TEST_MIN_REFERENCE_READING = 409;        // 2 volts
+const int SELF_TEST_MAX_REFERENCE_READING = 614;        // 3 volts
+const int SELF_TEST_MIN_CURRENT_READING = 8;            // closer to the limits than this, the sense amplifier is saturated
+const int SELF_TEST_MAX_CURRENT_READING = 1015;
+const long long SELF_TEST_MIN_MICRO_AMPS = -1500000LL;  // the fan and board use less than 1 amp
+const long long SELF_TEST_MAX_MICRO_AMPS = 3200000LL;   // the charger delivers about 2.7 amps
+const long long SELF_TEST_MAX_MICRO_AMPS_NOT_CHARGING = 300000LL; // without the charger, the current can't be positive
 
 /********************************************************************
  * Alert constants
  ********************************************************************/
 
-// Which LEDs to flash for each type of alert.
-const int batteryLowLEDs[] = { BATTERY_LED_LOW_PIN, CHARGING_LED_PIN , -1 };
-const int fanRPMLEDs[] = { FAN_LOW_LED_PIN, FAN_MED_LED_PIN, FAN_HIGH_LED_PIN, -1 };
-const int* alertLEDs[] = { 0, batteryLowLEDs, fanRPMLEDs }; // Indexed by enum Alert.
-
-// What are the on & off durations for the pulsed lights and buzzer for each type of alert. 
-const int batteryAlertMillis[] = { 1000, 1000 };
-const int fanAlertMillis[] = { 200, 200 };
-const int* alertMillis[] = { 0, batteryAlertMillis, fanAlertMillis }; // Indexed by enum Alert.
-
 // Buzzer settings.
-const long BUZZER_FREQUENCY = 2500; // in Hz
+const unsigned int BUZZER_FREQUENCY = 2500; // in Hz
 const int BUZZER_DUTYCYCLE = 50; // in percent
 
-// A "low battery" alarm is in effect whenever the battery level is at or below the "urgent" amount.
-// If a charger is connected then the red LED flashes until the level is above the urgent amount,
-// but the buzzer doesn't sound.
-// This percentage is supposed to occur when the battery has 30 minutes of charge left. To give a 
-// generous margin, it's actually about an hour.
-const int URGENT_BATTERY_PERCENT = 8;
+// The patterns of lights and sounds that the AlertSequencer plays. These live in program memory, so they use no RAM.
+// Each step is { LEDs that are on, buzzer frequency, buzzer duty cycle, duration in milliseconds }.
+#define STEP_COUNT(steps) (sizeof(steps) / sizeof(AlertStep))
+
+// Low battery: flash the red and amber LEDs and the buzzer, 1 second on and 1 second off.
+const AlertStep batteryAlertSteps[] PROGMEM = {
+    { BATTERY_LED_LOW_MASK | CHARGING_LED_MASK, BUZZER_FREQUENCY, BUZZER_DUTYCYCLE, 1000 },
+    { 0, 0, 0, 1000 }
+};
+const AlertPattern batteryAlertPattern PROGMEM = {
+    priorityBatteryAlert, BATTERY_LED_LOW_MASK | CHARGING_LED_MASK, 0, STEP_COUNT(batteryAlertSteps), batteryAlertSteps };
+
+// Fan RPM out of range: flash the fan LEDs and the buzzer rapidly.
+const AlertStep fanAlertSteps[] PROGMEM = {
+    { FAN_LOW_LED_MASK | FAN_MED_LED_MASK | FAN_HIGH_LED_MASK, BUZZER_FREQUENCY, BUZZER_DUTYCYCLE, 200 },
+    { 0, 0, 0, 200 }
+};
+const AlertPattern fanAlertPattern PROGMEM = {
+    priorityFanAlert, FAN_LOW_LED_MASK | FAN_MED_LED_MASK | FAN_HIGH_LED_MASK, 0, STEP_COUNT(fanAlertSteps), fanAlertSteps };
+
+const AlertPattern* const alertPatterns[] = { 0, &batteryAlertPattern, &fanAlertPattern }; // Indexed by enum Alert.
+
+// Charge reminder: a short beep and amber flash every 10 seconds.
+const AlertStep chargeReminderSteps[] PROGMEM = {
+    { CHARGING_LED_MASK, BUZZER_FREQUENCY, BUZZER_DUTYCYCLE, 500 },
+    { 0, 0, 0, 9500 }
+};
+const AlertPattern chargeReminderPattern PROGMEM = {
+    priorityReminder, CHARGING_LED_MASK, 0, STEP_COUNT(chargeReminderSteps), chargeReminderSteps };
+
+// Filter reminder: two short beeps and fan LED flashes every minute, when it's time to replace the filter.
+const AlertStep filterReminderSteps[] PROGMEM = {
+    { FAN_LOW_LED_MASK | FAN_MED_LED_MASK | FAN_HIGH_LED_MASK, BUZZER_FREQUENCY, BUZZER_DUTYCYCLE, 150 },
+    { 0, 0, 0, 150 },
+    { FAN_LOW_LED_MASK | FAN_MED_LED_MASK | FAN_HIGH_LED_MASK, BUZZER_FREQUENCY, BUZZER_DUTYCYCLE, 150 },
+    { 0, 0, 0, 59550 }
+};
+const AlertPattern filterReminderPattern PROGMEM = {
+    priorityFilterReminder, FAN_LOW_LED_MASK | FAN_MED_LED_MASK | FAN_HIGH_LED_MASK, 0, STEP_COUNT(filterReminderSteps), filterReminderSteps };
+
+// Power off warning: all LEDs and the buzzer stay on while the user holds the Power Off button.
+const AlertStep powerOffWarningSteps[] PROGMEM = {
+    { ALL_LEDS_MASK, BUZZER_FREQUENCY, BUZZER_DUTYCYCLE, 60000 }
+};
+const AlertPattern powerOffWarningPattern PROGMEM = {
+    priorityPowerOffWarning, ALL_LEDS_MASK, 0, STEP_COUNT(powerOffWarningSteps), powerOffWarningSteps };
+
+// Unusual reset: flash all the LEDs, 5 times after a watchdog reset or 10 times after a manual reset.
+const AlertStep resetFlashSteps[] PROGMEM = {
+    { ALL_LEDS_MASK, 0, 0, 100 },
+    { 0, 0, 0, 100 }
+};
+const AlertPattern watchdogResetPattern PROGMEM = {
+    priorityResetFlash, ALL_LEDS_MASK, 5, STEP_COUNT(resetFlashSteps), resetFlashSteps };
+const AlertPattern manualResetPattern PROGMEM = {
+    priorityResetFlash, ALL_LEDS_MASK, 10, STEP_COUNT(resetFlashSteps), resetFlashSteps };
+
+// The battery levels for the "low battery" alarm and the charge reminder are in Config.
+
+// Once the low battery alarm has started, the charge must rise this many percent before it stops, unless the charger
+// is connected. That keeps a small correction of the charge estimate from turning the alarm off and on again.
+const int URGENT_BATTERY_HYSTERESIS_PERCENT = 3;
 
 /********************************************************************
  * LED
@@ -132,76 +183,132 @@ void Main::allLEDsOff()
     }
 }
 
-// Turn on all LEDs
-void Main::allLEDsOn()
+// Set an indicator LED to a given state, unless an alert pattern is currently using that LED.
+void Main::setIndicatorLED(const int pin, int onOff)
 {
-    for (int i = 0; i < numLEDs; i += 1) {
-        setLED(LEDpins[i], LED_ON);
+    if (!alertSequencer.ownsLED(pin)) {
+        setLED(pin, onOff);
     }
 }
 
-// Set a list of LEDs to a given state.
-void Main::setLEDs(const int* pinList, int onOff)
+
+/********************************************************************
+ * Alert
+ ********************************************************************/
+
+// Raise an alert. We pulse the lights and buzzer to alert the user to a problem. A fan alert lasts until
+// the user turns the power off. Each kind of alert is raised on its own, whatever other alerts are active,
+// and AlertSequencer picks the one to play by priority. The fan alert takes precedence, because it means
+// the user is already losing airflow. A battery alert that starts during a fan alert is still counted,
+// logged and reported to the host.
+void Main::raiseAlert(Alert alert)
 {
-    for (int i = 0; pinList[i] != -1; i += 1) {
-        setLED(pinList[i], onOff);
+    usage.countEvent((alert == alertBatteryLow) ? usageBatteryAlert : usageFanAlert);
+    playAlert(alert);
+}
+
+// Raise an alert without counting it. We use this to carry on with an alert that was
+// raised, and counted, before a reset.
+void Main::playAlert(Alert alert)
+{
+    activeAlerts |= (1 << alert);
+    serialPrintf("Begin %s Alert", alertName(alert));
+    if (alert == alertBatteryLow) {
+        batteryAlertPercent = getBatteryPercentFull();
     }
+    alertSequencer.play(alertPatterns[alert]);
 }
 
-// Flash all the LEDS for a specified duration and number of flashes.
-void Main::flashAllLEDs(int millis, int count)
+// Turn off an alert, if it's active.
+void Main::cancelAlert(Alert alert)
 {
-    while (count--) {
-        allLEDsOn();
-        hw.delay(millis);
-        allLEDsOff();
-        hw.delay(millis);
+    if (isAlertActive(alert)) {
+        alertSequencer.stop(alertPatterns[alert]);
     }
+    activeAlerts &= ~(1 << alert);
 }
 
+// The most urgent active alert, which is the one AlertSequencer is playing (priorityFanAlert is higher
+// than priorityBatteryAlert).
+Alert Main::getCurrentAlert()
+{
+    return isAlertActive(alertFanRPM) ? alertFanRPM : (isAlertActive(alertBatteryLow) ? alertBatteryLow : alertNone);
+}
+
+// Turn the buzzer on or off.
+void Main::setBuzzer(int onOff) {
+    setBuzzerTone(onOff ? BUZZER_FREQUENCY : 0, BUZZER_DUTYCYCLE);
+}
+
+// Turn on the buzzer with a given frequency and duty cycle, or turn it off if the frequency is 0.
+void Main::setBuzzerTone(unsigned int frequencyHz, int dutyCyclePercent) {
+    //serialPrintf("set buzzer %u Hz", frequencyHz);
+    if (frequencyHz) {
+        if (spiPort.isOn()) {
+            spiPort.stop(); // the SPI port is using the buzzer pin
+        }
+        startPB2PWM(frequencyHz, dutyCyclePercent);
+    } else {
+        stopPB2PWM();
+    }
+    buzzerState = frequencyHz ? BUZZER_ON : BUZZER_OFF;
+}
 
 /********************************************************************
- * Alert
+ * Power-on self-test
  ********************************************************************/
 
-// This function pulses the lights and buzzer during an alert.
-void Main::onToggleAlert()
+// Check the hardware that we can check right away, then start selfTestTask to check the fan's tachometer
+// while the fan spins up. This way the self-test doesn't make startup any slower. If we go into a state
+// where the fan is off, enterState() stops the task.
+void Main::startSelfTest()
 {
-    alertToggle = !alertToggle;
-    setLEDs(currentAlertLEDs, alertToggle ? LED_ON : LED_OFF);
-    setBuzzer(alertToggle ? BUZZER_ON : BUZZER_OFF);
-    alertTimer.start(currentAlertMillis[alertToggle ? 0 : 1]);
-}
+    selfTestFailures = 0;
 
-// Enter the "alert" state. In this state we pulse the lights and buzzer to 
-// alert the user to a problem. Once we are in this state, the only
-// way out is for the user to turn the power off.
-void Main::raiseAlert(Alert alert)
-{
-    currentAlert = alert;
-    serialPrintf("Begin %s Alert", currentAlertName());
-    currentAlertLEDs = alertLEDs[alert];
-    currentAlertMillis = alertMillis[alert];
-    alertToggle = false;
-    onToggleAlert();
+    const long long microVolts = hw.readMicroVolts();
+    if (microVolts < SELF_TEST_MIN_MICRO_VOLTS || microVolts > SELF_TEST_MAX_MICRO_VOLTS) {
+        selfTestFailures |= selfTestVoltage;
+    }
+
+    const int reference = hw.analogRead(REFERENCE_VOLTAGE_PIN);
+    if (reference < SELF_TEST_MIN_REFERENCE_READING || reference > SELF_TEST_MAX_REFERENCE_READING) {
+        selfTestFailures |= selfTestReference;
+    }
+
+    const int current = hw.analogRead(CHARGE_CURRENT_PIN);
+    const long long microAmps = hw.readMicroAmps();
+    const long long maxMicroAmps = battery.isCharging() ? SELF_TEST_MAX_MICRO_AMPS : SELF_TEST_MAX_MICRO_AMPS_NOT_CHARGING;
+    if (current < SELF_TEST_MIN_CURRENT_READING || current > SELF_TEST_MAX_CURRENT_READING ||
+        microAmps < SELF_TEST_MIN_MICRO_AMPS || microAmps > maxMicroAmps) {
+        selfTestFailures |= selfTestCurrent;
+    }
+
+    if (!testPB2PWM(BUZZER_FREQUENCY)) {
+        selfTestFailures |= selfTestBuzzer;
+    }
+
+    selfTestTask.start();
 }
 
-// Turn off any active alert.
-void Main::cancelAlert()
+// Wait for the fan's tachometer to show some RPMs. Give up at the deadline.
+bool Main::selfTest(Task& task)
 {
-    currentAlert = alertNone;
-    alertTimer.cancel();
+    TASK_BEGIN(task);
+    TASK_WAIT_UNTIL(task, fanController.getRPM() > 0 || hw.millis() - selfTestStartMillis >= SELF_TEST_DEADLINE_MILLIS);
+    if (fanController.getRPM() == 0) {
+        selfTestFailures |= selfTestTach;
+    }
+    finishSelfTest();
+    TASK_END(task);
 }
 
-// Turn the buzzer on or off.
-void Main::setBuzzer(int onOff) {
-    //serialPrintf("set buzzer %s", onOff == BUZZER_OFF ? "off" : "on");
-    if (onOff) {
-        startPB2PWM(BUZZER_FREQUENCY, BUZZER_DUTYCYCLE);
-    } else {
-        stopPB2PWM();
+// Report the result of the self-test, and record any failures in the flight log.
+void Main::finishSelfTest()
+{
+    serialPrintf("Self test %s, failures %x, %lu ms", selfTestFailures ? "FAILED" : "passed", selfTestFailures, hw.millis() - selfTestStartMillis);
+    if (selfTestFailures) {
+        flightLog.add(eventSelfTestFailed, selfTestFailures, (long)(hw.readMicroVolts() / 1000));
     }
-    buzzerState = onOff;
 }
 
 /********************************************************************
@@ -211,20 +318,22 @@ void Main::setBuzzer(int onOff) {
 // Update the fan indicator LEDs to correspond to the current fan setting.
 void Main::updateFanLEDs()
 {
-    setLED(FAN_LOW_LED_PIN, LED_ON);
-    setLED(FAN_MED_LED_PIN, currentFanSpeed > fanLow ? LED_ON : LED_OFF);
-    setLED(FAN_HIGH_LED_PIN, currentFanSpeed == fanHigh ? LED_ON : LED_OFF);
+    setIndicatorLED(FAN_LOW_LED_PIN, LED_ON);
+    setIndicatorLED(FAN_MED_LED_PIN, currentFanSpeed > fanLow ? LED_ON : LED_OFF);
+    setIndicatorLED(FAN_HIGH_LED_PIN, currentFanSpeed == fanHigh ? LED_ON : LED_OFF);
 }
 
 // Set the fan to the indicated speed, and update the fan indicator LEDs.
 void Main::setFanSpeed(FanSpeed speed)
 {
-    fanController.setDutyCycle(fanDutyCycles[speed]);
+    fanController.rampDutyCycle(fanDutyCycles[speed]);
     currentFanSpeed = speed;
+    battery.setFanSpeed(speed);
+    battery.setFanSettling(true);
     updateFanLEDs();
     serialPrintf("Set Fan Speed %d", speed);
 
-    // disable fan RPM monitor for a few seconds, until the new fan speed stabilizes
+    // disable fan RPM monitor until the new fan speed settles
     lastFanSpeedChangeMilliSeconds = hw.millis();
     fanSpeedRecentlyChanged = true;
 }
@@ -234,27 +343,70 @@ void Main::checkForFanAlert() {
     const unsigned int fanRPM = fanController.getRPM(); 
     // Note: we call getRPM() even if we're not going to use the result, because getRPM() works better if you call it often.
 
-    // If fan RPM checking is temporarily disabled, then do nothing.
+    const byte dutyCycle = fanDutyCycles[currentFanSpeed];
+    const unsigned int expectedRPM = fanController.getExpectedRPM(dutyCycle);
+    const unsigned int toleranceRPM = fanController.getRPMTolerance(dutyCycle);
+    const bool rpmInRange = (fanRPM + toleranceRPM >= expectedRPM) && (fanRPM <= expectedRPM + toleranceRPM);
+
+    // If fan RPM checking is temporarily disabled, then do nothing. We end the blind period early only when the fan
+    // has settled at the speed we expect. A fan that settles at the wrong speed gets the full settle time
+    // before we raise an alert, in case it's still spinning up or down slowly.
     if (fanSpeedRecentlyChanged) {
-        if (hw.millis() - lastFanSpeedChangeMilliSeconds < FAN_STABILIZE_MILLIS) {
+        if (!(fanController.isSettled() && rpmInRange) && hw.millis() - lastFanSpeedChangeMilliSeconds < config.fanMaxSettleMillis) {
             return;
         }
         fanSpeedRecentlyChanged = false;
+        battery.setFanSettling(false);
     }
 
     // If the RPM is too low or too high compared to the expected value, raise an alert.
-    const unsigned int expectedRPM = expectedFanRPM[currentFanSpeed];
-    if ((fanRPM < (LOWEST_FAN_OK_RPM * expectedRPM)) || (fanRPM > (HIGHEST_FAN_OK_RPM * expectedRPM))) {
+    if (!rpmInRange) {
         raiseAlert(alertFanRPM);
     }
 }
 
+// Called once a second while the fan is on. We update the fan health statistics, and the estimate of how clogged
+// the filter is, and remind the user to replace the filter when necessary. We skip the times when the fan is
+// changing speed. The filter estimate compares the fan's power with the fan curve, so we also skip the times
+// when something else is using (or providing) current, and we take out the LEDs that are on right now.
+void Main::onFanHealthCheck() {
+    const byte dutyCycle = fanDutyCycles[currentFanSpeed];
+    if (fanController.isSettled()) {
+        fanController.updateHealth(currentFanSpeed);
+    }
+    if (!battery.isCharging() && buzzerState == BUZZER_OFF && fanController.isSettled()) {
+        int ledsOn = 0;
+        for (int i = 0; i < numLEDs; i += 1) {
+            if (ledState[i] == LED_ON) ledsOn += 1;
+        }
+        filterMonitor.update(fanController.getRPM(), fanController.getExpectedRPM(dutyCycle),
+            hw.readFanMilliWatts(ledsOn), fanController.getExpectedMilliWatts(dutyCycle));
+    }
+
+    if (filterMonitor.shouldReplaceFilter()) {
+        if (!filterReminderOn) {
+            usage.countEvent(usageFilterReminder);
+        }
+        alertSequencer.play(&filterReminderPattern);
+    } else {
+        alertSequencer.stop(&filterReminderPattern);
+    }
+    filterReminderOn = filterMonitor.shouldReplaceFilter();
+}
+
 /********************************************************************
  * Battery
  ********************************************************************/
 
 int Main::getBatteryPercentFull() {
-    return (int)((battery.getPicoCoulombs() - BATTERY_MIN_CHARGE_PICO_COULOMBS) / ((BATTERY_CAPACITY_PICO_COULOMBS - BATTERY_MIN_CHARGE_PICO_COULOMBS) / 100LL));
+    return (int)((battery.getPicoCoulombs() - config.batteryMinChargePicoCoulombs) / ((battery.getCapacityPicoCoulombs() - config.batteryMinChargePicoCoulombs) / 100LL));
+}
+
+// Is the battery level at or below the given amount? We go by the estimated time remaining at the
+// current load if we have it, otherwise by the percentage.
+bool Main::isBatteryBelow(int minutes, int percent) {
+    const int minutesRemaining = battery.getMinutesRemaining();
+    return (minutesRemaining >= 0) ? (minutesRemaining <= minutes) : (getBatteryPercentFull() <= percent);
 }
 
 // Call this periodically to update the battery and charging LEDs.
@@ -263,61 +415,53 @@ void Main::updateBatteryLEDs() {
 
     // Decide if the red LED should be on or not.
     bool redLED = (percentFull < 40);
-    if (percentFull <= URGENT_BATTERY_PERCENT) {
+    if (isBatteryBelow(config.urgentBatteryMinutes, config.urgentBatteryPercent)) {
         // The battery level is really low. Flash the LED.
         bool ledToggle = (hw.millis() / 1000) & 1;
         redLED = redLED && ledToggle;
     }
 
     // Turn on/off the battery LEDs as required
-    setLED(BATTERY_LED_LOW_PIN, redLED ? LED_ON : LED_OFF); // red
-    setLED(BATTERY_LED_MED_PIN, ((percentFull > 15) && (percentFull < 97)) ? LED_ON : LED_OFF); // yellow
-    setLED(BATTERY_LED_HIGH_PIN, (percentFull > 70) ? LED_ON : LED_OFF); // green
-
-    // Turn on/off the charging indicator LED as required
-    setLED(CHARGING_LED_PIN, battery.isCharging() ? LED_ON : LED_OFF); // orange
+    setIndicatorLED(BATTERY_LED_LOW_PIN, redLED ? LED_ON : LED_OFF); // red
+    setIndicatorLED(BATTERY_LED_MED_PIN, ((percentFull > 15) && (percentFull < 97)) ? LED_ON : LED_OFF); // yellow
+    setIndicatorLED(BATTERY_LED_HIGH_PIN, (percentFull > 70) ? LED_ON : LED_OFF); // green
+
+    // Turn on/off the charging indicator LED as required. When the charge current starts tapering off,
+    // the battery is nearly full, so we flash the LED.
+    bool chargingLED = battery.isCharging();
+    if (battery.getChargePhase() == chargePhaseConstantVoltage) {
+        bool ledToggle = (hw.millis() / 1000) & 1;
+        chargingLED = ledToggle;
+    }
+    setIndicatorLED(CHARGING_LED_PIN, chargingLED ? LED_ON : LED_OFF); // orange
     
     // Maybe turn the charge reminder on or off.
-    // The "charge reminder" is the periodic beep that occurs when the battery is below 15%
+    // The "charge reminder" is the periodic beep that occurs when the battery is getting low
     // to remind the user to recharge the unit as soon as possible.
-    if (!battery.isCharging() && percentFull <= 15 && currentAlert != alertBatteryLow) {
-        if (!chargeReminder.isActive()) {
-            onChargeReminder();
-            chargeReminder.start();
-        }
+    if (!battery.isCharging() && isBatteryBelow(config.reminderBatteryMinutes, config.reminderBatteryPercent) && !isAlertActive(alertBatteryLow)) {
+        alertSequencer.play(&chargeReminderPattern);
     } else {
-        chargeReminder.stop();
+        alertSequencer.stop(&chargeReminderPattern);
     }
 }
 
 // Call this periodically to decide if a battery alert should be started or terminated.
+// Once the alert has started, the time remaining isn't enough to end it: turning the fan down makes the time
+// jump up, but the battery is just as empty as before. Unless the charger is connected, the charge itself has
+// to come back up by URGENT_BATTERY_HYSTERESIS_PERCENT, which only happens if the charge estimate was too low.
 void Main::checkForBatteryAlert()
 {
-    if (currentAlert == alertBatteryLow) {
-        if (battery.isCharging() || getBatteryPercentFull() > URGENT_BATTERY_PERCENT) {
-            cancelAlert();
+    if (isAlertActive(alertBatteryLow)) {
+        if (battery.isCharging() || (!isBatteryBelow(config.urgentBatteryMinutes, config.urgentBatteryPercent) &&
+            getBatteryPercentFull() >= batteryAlertPercent + URGENT_BATTERY_HYSTERESIS_PERCENT)) {
+            cancelAlert(alertBatteryLow);
         }
-    } else if (getBatteryPercentFull() <= URGENT_BATTERY_PERCENT && !battery.isCharging()) {
-        chargeReminder.stop();
+    } else if (isBatteryBelow(config.urgentBatteryMinutes, config.urgentBatteryPercent) && !battery.isCharging()) {
+        alertSequencer.stop(&chargeReminderPattern);
         raiseAlert(alertBatteryLow);
     }
 }
 
-// This is the callback function for chargeReminder. When it's active, this function gets called every minute or so.
-// We turn on the buzzer and the charging LED, then set a timer for when to turn buzzer and LED off.
-void Main::onChargeReminder() {
-    serialPrintf("reminder beep");
-    setBuzzer(BUZZER_ON);
-    setLED(CHARGING_LED_PIN, LED_ON);
-    beepTimer.start(500);
-}
-
-// This is the callback function for beepTimer. This function gets called to turn off the chargeReminder buzzer and LED. 
-void Main::onBeepTimer() {
-    setBuzzer(BUZZER_OFF);
-    setLED(CHARGING_LED_PIN, LED_OFF);
-}
-
 /********************************************************************
  * states and modes
  ********************************************************************/
@@ -328,6 +472,7 @@ void Main::enterState(PAPRState newState)
     serialPrintf("\r\nenter state %s", STATE_NAMES[newState]);
     onStatusReport();
 
+    updateUsage(); // count the time up to now against the old state
     paprState = newState;
     switch (newState) {
         case stateOn:
@@ -335,30 +480,90 @@ void Main::enterState(PAPRState newState)
             hw.digitalWrite(FAN_ENABLE_PIN, FAN_ON);
             setFanSpeed(currentFanSpeed);
             setBuzzer(BUZZER_OFF);
-            if (currentAlert != alertFanRPM) {
-                updateFanLEDs();
-            }
-            if (currentAlert != alertBatteryLow) {
-                updateBatteryLEDs();
-            }
+            updateFanLEDs();
+            updateBatteryLEDs();
             break;
 
         case stateOff:
         case stateOffCharging:
+            if (selfTestTask.isActive()) {
+                // The fan is stopping, so we can't check its tachometer.
+                selfTestTask.stop();
+                finishSelfTest();
+            }
             pinMode(BUZZER_PIN, INPUT); // tri-state the output pin, so the buzzer receives no signal and consumes no power.
             hw.digitalWrite(FAN_ENABLE_PIN, FAN_OFF);
             currentFanSpeed = DEFAULT_FAN_SPEED;
-            cancelAlert();
+            fanController.setDutyCycle(fanDutyCycles[DEFAULT_FAN_SPEED]); // so the fan starts gently next time
+            activeAlerts = 0;
+            alertSequencer.stopAll();
             allLEDsOff();
             break;
     }
+    usage.maybeSave();
+    updateResumeSnapshot();
     onStatusReport();
 }
 
+// Record the current state in resumeSnapshot. This is cheap (about 25 microseconds), so we do it every time through loop().
+void Main::updateResumeSnapshot()
+{
+    resumeSnapshot.paprState = paprState;
+    resumeSnapshot.fanSpeed = currentFanSpeed;
+    resumeSnapshot.alerts = activeAlerts;
+    resumeSnapshot.chargeIsCalibrated = battery.isCalibrated();
+    resumeSnapshot.picoCoulombs = battery.getPicoCoulombs();
+    resumeSnapshot.checksum = checksum(&resumeSnapshot, offsetof(ResumeSnapshot, checksum));
+}
+
+// Count the time and the battery charge in the usage statistics. The fan is only running when the power is on.
+void Main::updateUsage()
+{
+    long long inPicoCoulombs, outPicoCoulombs;
+    battery.takeChargeFlow(&inPicoCoulombs, &outPicoCoulombs);
+    usage.addCharge(inPicoCoulombs, outPicoCoulombs);
+    const bool fanRunning = (paprState == stateOn || paprState == stateOnCharging);
+    usage.update(paprState, fanRunning ? currentFanSpeed : -1);
+}
+
+// Fill in the telemetry that the SPI port gives to the host.
+void Main::getTelemetry(SPITelemetry& telemetry)
+{
+    telemetry.state = paprState;
+    telemetry.fanSpeed = currentFanSpeed;
+    telemetry.alert = getCurrentAlert();
+    telemetry.flags = (battery.isCharging() ? SPI_FLAG_CHARGING : 0) | (filterReminderOn ? SPI_FLAG_REPLACE_FILTER : 0) |
+        (isAlertActive(alertBatteryLow) ? SPI_FLAG_BATTERY_ALERT : 0);
+    telemetry.batteryPercent = constrain(getBatteryPercentFull(), 0, 100);
+    telemetry.fanRPM = fanController.getRPM();
+    telemetry.milliVolts = (long)(hw.readMicroVolts() / 1000LL);
+    telemetry.milliAmps = (long)(hw.readMicroAmps() / 1000LL);
+    telemetry.coulombs = (long)(battery.getPicoCoulombs() / 1000000000000LL);
+    telemetry.minutesRemaining = battery.getMinutesRemaining();
+    telemetry.minutesToFull = battery.getMinutesToFull();
+    telemetry.filterRestriction = filterMonitor.getRestrictionIndex();
+    telemetry.usage = usage.getCounters();
+}
+
+// Load a record from EEPROM for the SPI port. Returns its size, or 0 if there's no such record.
+byte Main::getRecord(byte kind, byte age, byte* data)
+{
+    switch (kind) {
+        case spiRecordFlightLog:
+            return flightLog.get(age, (FlightLogEntry*)data) ? sizeof(FlightLogEntry) : 0;
+        case spiRecordFanHealthHour:
+            return fanController.getHealthHour(age, (FanHealthRecord*)data) ? sizeof(FanHealthRecord) : 0;
+        case spiRecordFanHealthDay:
+            return fanController.getHealthDay(age, (FanHealthDayRecord*)data) ? sizeof(FanHealthDayRecord) : 0;
+    }
+    return 0;
+}
+
 // Set the PCB to its low power state, and put the MCU into its lowest power sleep mode.
 // This function will return only when the user presses the Power On button,
-// or until the charger is connected. While we are napping, the system uses a negligible amount
-// of power, perhaps 1-3% of a full battery charge every month.
+// or until the charger is connected. While we are napping, the system uses a tiny amount
+// of power, perhaps 1-3% of a full battery charge every month. We tell the battery how long we
+// slept, so it can account for that.
 //
 // Be careful inside this function, it's the only place where we mess around with
 // power, speed, watchdog, and sleeping. If you break this code it will mess up
@@ -368,68 +573,63 @@ void Main::enterState(PAPRState newState)
 // and the watchdog timer MUST be enabled. 
 void Main::nap()
 {
+    battery.saveCoulombCount();
     hw.wdt_disable();
+    const unsigned long napStartMillis = hw.millis();
     hw.setPowerMode(lowPowerMode);
+
+    // The millis() clock stops while we sleep, so we count the sleep periods ourselves. Usually the watchdog
+    // timer ends each sleep after NAP_SLEEP_MILLIS. If a pin change (such as the Power On button) ends it early,
+    // we can't tell how much of the period had gone by, so we count half of it. That's right on average,
+    // and never more than half a period out. The watchdog's oscillator is only accurate to about 10%, so we
+    // don't try to do any better than that.
+    unsigned long sleptMillis = 0;
+    PAPRState newState;
     while (true) {
+        const byte pinChanges = hw.getPinChangeCount();
         LowPower.powerDown(SLEEP_1S, ADC_OFF, BOD_OFF);
+        sleptMillis += (hw.getPinChangeCount() == pinChanges) ? NAP_SLEEP_MILLIS : NAP_SLEEP_MILLIS / 2;
 
         if (battery.isCharging()) {
-            hw.setPowerMode(fullPowerMode);
-            enterState(stateOffCharging);
-            hw.wdt_enable(WDTO_8S);
-            return;
+            newState = stateOffCharging;
+            break;
+        }
+
+        // A host is selecting the SPI port. The port needs full power, so stay awake while loop() does the handshake.
+        if (hw.digitalRead(SPI_SCK_PIN) == LOW) {
+            newState = stateOff;
+            break;
         }
 
         long wakeupTime = hw.millis();
+        bool powerOnHeld = false;
         while (hw.digitalRead(POWER_ON_PIN) == BUTTON_PUSHED) {
             if (hw.millis() - wakeupTime > 125) { // we're at 1/8 speed, so this is really 1000 ms (8 * 125)
-                hw.setPowerMode(fullPowerMode);
-                enterState(stateOn);
-                while (hw.digitalRead(POWER_ON_PIN) == BUTTON_PUSHED) {}
-                hw.wdt_enable(WDTO_8S);
-                return;
+                powerOnHeld = true;
+                break;
             }
         }
+        if (powerOnHeld) {
+            newState = stateOn;
+            break;
+        }
     }
+
+    // While we were awake in low power mode, millis() ran at the slower clock speed, so it only counted
+    // 1/LOW_POWER_CLOCK_DIVISOR of the real time.
+    sleptMillis += (hw.millis() - napStartMillis) * (LOW_POWER_CLOCK_DIVISOR - 1);
+
+    hw.setPowerMode(fullPowerMode);
+    hw.addMillis(sleptMillis);
+    battery.wakeUp(sleptMillis);
+    enterState(newState);
+    hw.wdt_enable(WDTO_8S);
 }
 
 /********************************************************************
  * UI event handlers
  ********************************************************************/
 
-// when the user presses Power Off, we want to give the user an audible and visible signal
-// in case they didn't mean to do it. If the user holds the button long enough we return true,
-// meaning that the user really wants to do it.
-bool Main::doPowerOffWarning()
-{
-    // Turn on all LEDs, and the buzzer
-    allLEDsOn();
-    setBuzzer(BUZZER_ON);
-
-    // If the user holds the button for long enough, we will return true,
-    // which tells the caller to go ahead and enter the off state. 
-    unsigned long startMillis = hw.millis();
-    while (hw.digitalRead(POWER_OFF_PIN) == BUTTON_PUSHED) {
-        if (hw.millis() - startMillis > POWER_OFF_BUTTON_HOLD_MILLIS) {
-            allLEDsOff();
-            setBuzzer(BUZZER_OFF);
-            return true;
-        }
-    }
-
-    // The user did not hold the button long enough. Restore the UI
-    // and tell the caller not to enter the off state.
-    allLEDsOff();
-    setBuzzer(BUZZER_OFF);
-    if (currentAlert != alertFanRPM) {
-        updateFanLEDs();
-    }
-    if (currentAlert != alertBatteryLow) {
-        updateBatteryLEDs();
-    }
-    return false;
-}
-
 // This function gets called when the user presses the Power On button
 void Main::onPowerOnPress()
 {
@@ -446,14 +646,29 @@ void Main::onPowerOnPress()
     }
 }
 
-// This function gets called when the user presses the Power On button
+// This function gets called when the user presses the Power Off button.
+// We want to give the user an audible and visible signal in case they didn't mean to do it,
+// so we turn on all the LEDs and the buzzer for as long as the button is held.
 void Main::onPowerOffPress()
 {
+    alertSequencer.play(&powerOffWarningPattern);
+}
+
+// This function gets called when the user releases the Power Off button. If the user didn't hold
+// the button long enough, we stop the warning and the UI goes back to what it was showing before.
+void Main::onPowerOffRelease()
+{
+    alertSequencer.stop(&powerOffWarningPattern);
+}
+
+// This function gets called when the user has held the Power Off button long enough,
+// meaning that the user really wants to turn the power off.
+void Main::onPowerOffHold()
+{
+    alertSequencer.stop(&powerOffWarningPattern);
     switch (paprState) {
         case stateOn:
-            if (doPowerOffWarning()) {
-                enterState(stateOff);
-            }
+            enterState(stateOff);
             break;
 
         case stateOff:
@@ -462,9 +677,7 @@ void Main::onPowerOffPress()
             break;
 
         case stateOnCharging:
-            if (doPowerOffWarning()) {
-                enterState(stateOffCharging);
-            }
+            enterState(stateOffCharging);
             break;
     }
 }
@@ -516,28 +729,37 @@ void Main::callback()
 
 Main::Main() :
     // In the following code we are using the c++ lambda expressions as glue to our event handler functions.
-    buttonFanUp(FAN_UP_PIN, BUTTON_DEBOUNCE_MILLIS,
+    // The buttons' timings come from Config, which isn't loaded yet, so setup() sets them.
+    buttonFanUp(FAN_UP_PIN, 0,
         []() { instance->onFanUpPress(); }),
-    buttonFanDown(FAN_DOWN_PIN, BUTTON_DEBOUNCE_MILLIS,
+    buttonFanDown(FAN_DOWN_PIN, 0,
         []() { instance->onFanDownPress(); }),
-    buttonPowerOff(POWER_OFF_PIN, POWER_OFF_BUTTON_DEBOUNCE_MILLIS, 
-        []() { instance->onPowerOffPress(); }),
-    buttonPowerOn(POWER_ON_PIN, BUTTON_DEBOUNCE_MILLIS, 
+    buttonPowerOff(POWER_OFF_PIN, 0, 
+        []() { instance->onPowerOffPress(); },
+        []() { instance->onPowerOffRelease(); }),
+    buttonPowerOffHold(POWER_OFF_PIN, 0,
+        []() { instance->onPowerOffHold(); }),
+    buttonPowerOn(POWER_ON_PIN, 0, 
         []() { instance->onPowerOnPress(); }),
-    alertTimer(
-        []() { instance->onToggleAlert(); }),
-    beepTimer(
-        []() { instance->onBeepTimer(); }),
-    chargeReminder(10000, 
-        []() { instance->onChargeReminder(); }),
-    statusReport(10000, 
-        []() { instance->onStatusReport(); }),
     fanController(FAN_RPM_PIN, FAN_SPEED_READING_INTERVAL, FAN_PWM_PIN),
     currentFanSpeed(fanLow),
     fanSpeedRecentlyChanged(false),
+    fanHealthCheck(1000,
+        []() { instance->onFanHealthCheck(); }),
+    filterReminderOn(false),
+    activeAlerts(0),
+    batteryAlertPercent(0),
+    alertSequencer(
+        [](int pin, int onOff) { instance->setLED(pin, onOff); },
+        [](unsigned int frequencyHz, int dutyCyclePercent) { instance->setBuzzerTone(frequencyHz, dutyCyclePercent); }),
+    selfTestTask([](Task& task) { return instance->selfTest(task); }),
+    paprState(stateOff),
     ledState({ LED_OFF, LED_OFF, LED_OFF, LED_OFF, LED_OFF, LED_OFF, LED_OFF}),
     buzzerState(BUZZER_OFF),
-    currentAlert(alertNone)
+    statusReport(10000, 
+        []() { instance->onStatusReport(); }),
+    spiPort([](SPITelemetry& telemetry) { instance->getTelemetry(telemetry); },
+        [](byte kind, byte age, byte* data) { return instance->getRecord(kind, age, data); })
 {
     instance = this;
 }
@@ -547,24 +769,48 @@ void Main::setup()
 {
     // Make sure watchdog is off. Remember what kind of reset just happened. Setup the hardware.
     int resetFlags = hw.watchdogStartup();
+    config.load();
     hw.setup();
+    selfTestStartMillis = hw.millis();
+
+    // If the MCU was reset without losing power, and we have a valid snapshot of the state before the reset,
+    // then we will resume that state. Set the fan speed first thing, before the logging and the EEPROM writes
+    // below, so the airflow barely changes.
+    const bool resuming = (resetFlags & ((1 << WDRF) | (1 << BORF))) &&
+        (resumeSnapshot.checksum == checksum(&resumeSnapshot, offsetof(ResumeSnapshot, checksum)));
+    const FanSpeed initialFanSpeed = resuming ? (FanSpeed)resumeSnapshot.fanSpeed : DEFAULT_FAN_SPEED;
+    fanController.begin();
+    fanController.setDutyCycle(fanDutyCycles[initialFanSpeed]); // no ramp: if we're resuming, the fan is already at this speed
+    fanController.setSlewRate(config.fanSlewPercentPerSecond);
 
     // Initialize the serial port and print some initial debug info.
     #ifdef SERIAL_ENABLED
-    delay(1000);
     serialInit();
     serialPrintf("%s, MCUSR = %x", PRODUCT_ID, resetFlags);
     #endif
+    config.dump();
+    flightLog.begin();
+    flightLog.dump();
+    usage.begin();
+    usage.countReset(resetFlags);
+    usage.dump();
+    fanController.dumpHealth();
+    setFanSpeed(initialFanSpeed);
 
     // Decide what state we should be in.
     PAPRState initialState;
-    if (resetFlags & (1 << WDRF)) {
+    const AlertPattern* resetPattern = 0;
+    if (resuming) {
+        // Go back to whichever state we were in. Tell the user that something unusual happened.
+        initialState = (resumeSnapshot.paprState == stateOn || resumeSnapshot.paprState == stateOnCharging) ? stateOn : stateOff;
+        resetPattern = &watchdogResetPattern;
+    } else if (resetFlags & (1 << WDRF)) {
         // Watchdog timer expired. Tell the user that something unusual happened.
-        flashAllLEDs(100, 5);
+        resetPattern = &watchdogResetPattern;
         initialState = stateOn;
     } else if (resetFlags == 0) {
         // Manual reset. Tell the user that something unusual happened.
-        flashAllLEDs(100, 10);
+        resetPattern = &manualResetPattern;
         initialState = stateOn;
     } else {
         // It's a simple power-on. This will happen when:
@@ -576,46 +822,64 @@ void Main::setup()
         initialState = (PAPRState)((int)initialState + 2);
     }
 
-    // Initialize the fan
-    fanController.begin();
-    setFanSpeed(DEFAULT_FAN_SPEED);
-
     // Enable the watchdog timer. (Note: Don't make the timeout value too small - we need to give the IDE a chance to
     // call the bootloader in case something dumb happens during development and the WDT
     // resets the MCU too quickly. Once the code is solid, you could make it shorter.)
     wdt_enable(WDTO_8S);
 
+    buttonFanUp.setRequiredMillis(config.buttonDebounceMillis);
+    buttonFanDown.setRequiredMillis(config.buttonDebounceMillis);
+    buttonPowerOff.setRequiredMillis(config.powerOffButtonDebounceMillis);
+    buttonPowerOffHold.setRequiredMillis(config.powerOffButtonDebounceMillis + config.powerOffButtonHoldMillis);
+    buttonPowerOn.setRequiredMillis(config.buttonDebounceMillis);
+
     // Enable pin-change interrupts for the Power On button, and register a callback to handle those interrupts.
     // The interrupt serves 2 distinct purposes: (1) to get this callback called, and (2) to wake us up if we're napping.
     hw.setPowerOnButtonInterruptCallback(this);
 
     // and we're done!
-    battery.initializeCoulombCount();
+    battery.initializeCoulombCount(resetFlags & (1 << PORF));
+    if (resuming) {
+        battery.resumeCoulombCount(resumeSnapshot.picoCoulombs, resumeSnapshot.chargeIsCalibrated);
+    }
+    const byte resumeAlerts = resuming ? resumeSnapshot.alerts : 0;
+    startSelfTest();
     enterState(initialState);
+    if (initialState == stateOn || initialState == stateOnCharging) {
+        if (resumeAlerts & (1 << alertBatteryLow)) {
+            playAlert(alertBatteryLow);
+        }
+        if (resumeAlerts & (1 << alertFanRPM)) {
+            playAlert(alertFanRPM);
+        }
+    }
+    if (resetPattern) {
+        // The flashing happens while the main loop runs, so the fan is monitored right from the start.
+        alertSequencer.play(resetPattern);
+    }
     statusReport.start();
+    fanHealthCheck.start();
 }
 
 // Call the update() function of everybody who wants to do something each time through the loop() function.
 void Main::doAllUpdates()
 {
     battery.update();
-    if (currentAlert == alertNone) {
+    fanController.update();
+    selfTestTask.update();
+    if (!isAlertActive(alertFanRPM)) {
         checkForFanAlert();
     }
-    if (currentAlert != alertFanRPM) {
-        updateFanLEDs();
-    }
+    updateFanLEDs();
     checkForBatteryAlert();
-    if (currentAlert != alertBatteryLow) {
-        updateBatteryLEDs();
-    }
+    updateBatteryLEDs();
     buttonFanUp.update();
     buttonFanDown.update();
     buttonPowerOff.update();
-    alertTimer.update();
-    chargeReminder.update();
-    beepTimer.update();
+    buttonPowerOffHold.update();
+    alertSequencer.update();
     statusReport.update();
+    fanHealthCheck.update();
 }
 
 // This is our main function, which gets called over and over again, forever.
@@ -641,9 +905,12 @@ void Main::loop()
         case stateOff:
             // We are not charging so there are no LEDs to update.
             // We have nothing to do except take a nap. Our nap will end
-            // when the state is no longer stateOff.
-            nap();
-            battery.wakeUp();
+            // when the state is no longer stateOff, or when a host starts to select
+            // the SPI port. The port doesn't work while we nap, so we stay awake while
+            // a host is selecting or using it.
+            if (!spiPort.isActive()) {
+                nap();
+            }
             break;
 
         case stateOffCharging:
@@ -660,15 +927,19 @@ void Main::loop()
             statusReport.update();
             break;
     }
+
+    updateUsage();
+    spiPort.update((paprState == stateOff || paprState == stateOffCharging) && buzzerState == BUZZER_OFF);
+    updateResumeSnapshot();
 }
 
 // Write a one-line summary of the status of everything. For use in testing and debugging.
 void Main::onStatusReport() {
     #ifdef SERIAL_ENABLED
-    serialPrintf("Fan,%s,Buzzer,%s,Alert,%s,Charging,%s,LEDs,%s,%s,%s,%s,%s,%s,%s,milliVolts,%ld,milliAmps,%ld,Coulombs,%ld,charge,%d%%",
+    serialPrintf("Fan,%s,Buzzer,%s,Alert,%s,Charging,%s,LEDs,%s,%s,%s,%s,%s,%s,%s,milliVolts,%ld,milliAmps,%ld,Coulombs,%ld,charge,%d%%,minutesLeft,%d,minutesToFull,%d,AVCC,%ld,filter,%d",
         (currentFanSpeed == fanLow) ? "lo" : ((currentFanSpeed == fanMedium) ? "med" : "hi"),
         (buzzerState == BUZZER_ON) ? "on" : "off",
-        currentAlertName(),
+        alertName(getCurrentAlert()),
         battery.isCharging() ? "yes" : "no",
         (ledState[0] == LED_ON) ? "red" : "---",
         (ledState[1] == LED_ON) ? "yellow" : "---",
@@ -680,7 +951,11 @@ void Main::onStatusReport() {
         (long)(hw.readMicroVolts() / 1000LL),
         (long)(hw.readMicroAmps() / 1000LL),
         (long)(battery.getPicoCoulombs() / 1000000000000LL),
-        getBatteryPercentFull());
+        getBatteryPercentFull(),
+        battery.getMinutesRemaining(),
+        battery.getMinutesToFull(),
+        hw.getAVCCMilliVolts(),
+        filterMonitor.getRestrictionIndex());
     #endif
 }
 
@@ -8,6 +8,12 @@
 #include "Timer.h"
 #include "Battery.h"
 #include "PeriodicCallback.h"
+#include "AlertSequencer.h"
+#include "FlightLog.h"
+#include "FilterMonitor.h"
+#include "UsageCounters.h"
+#include "SPIPort.h"
+#include "Task.h"
 #ifdef UNITTEST
 #include "UnitTest/MyButtonDebounce.h"
 #include "UnitTest/MyFanController.h"
@@ -33,6 +39,15 @@ enum FanSpeed { fanLow, fanMedium, fanHigh };
 // and then monitor the charging (if stateOffCharging) or take a low-power nap (if stateOff).
 enum PAPRState { stateOff, stateOn, stateOffCharging, stateOnCharging };
 
+// The checks that the power-on self-test does. When checks fail, the flight log records which ones, as a bit mask.
+enum SelfTestCheck {
+    selfTestVoltage = 1 << 0,   // the battery voltage reading is in range
+    selfTestReference = 1 << 1, // the current sensor's reference voltage is near the middle of the ADC range
+    selfTestCurrent = 1 << 2,   // the current reading isn't saturated, and makes sense for whether the charger is connected
+    selfTestBuzzer = 1 << 3,    // the buzzer's timer can be configured
+    selfTestTach = 1 << 4       // the fan's tachometer is producing a signal
+};
+
 class Main : public InterruptCallback {
 public:
     Main();
@@ -46,6 +61,7 @@ public:
     PressDetector buttonFanUp;
     PressDetector buttonFanDown;
     PressDetector buttonPowerOff;
+    PressDetector buttonPowerOffHold;
     PressDetector buttonPowerOn;
 
     // The object that controls and monitors the fan.
@@ -54,32 +70,41 @@ public:
 private:
     // Internal functions
     void allLEDsOff();
-    void allLEDsOn();
     void setLED(const int pin, int onOff);
-    void setLEDs(const int* pinList, int onOff);
-    void flashAllLEDs(int millis, int count);
-    void onToggleAlert();
-    void onChargeReminder();
+    void setIndicatorLED(const int pin, int onOff);
     void onStatusReport();
-    void onBeepTimer();
     void raiseAlert(Alert alert);
+    void playAlert(Alert alert);
+    void cancelAlert(Alert alert);
+    bool isAlertActive(Alert alert) { return (activeAlerts & (1 << alert)) != 0; }
+    Alert getCurrentAlert();
     void setFanSpeed(FanSpeed speed);
     void checkForFanAlert();
+    void onFanHealthCheck();
     void checkForBatteryAlert();
     void onPowerOffPress();
+    void onPowerOffRelease();
+    void onPowerOffHold();
     void onPowerOnPress();
     void onFanDownPress();
     void onFanUpPress();
     void enterState(PAPRState newState);
+    void updateResumeSnapshot();
+    void updateUsage();
+    void getTelemetry(SPITelemetry& telemetry);
+    byte getRecord(byte kind, byte age, byte* data);
     void nap();
     void doAllUpdates();
     void updateFanLEDs();
     void updateBatteryLEDs();
-    void cancelAlert();
-    bool doPowerOffWarning();
     int getBatteryPercentFull();
+    bool isBatteryBelow(int minutes, int percent);
     void setBuzzer(int onOff);
-    const char* currentAlertName() { return (currentAlert == alertNone) ? "no" : ((currentAlert == alertBatteryLow) ? "batt" : "fan"); }
+    void setBuzzerTone(unsigned int frequencyHz, int dutyCyclePercent);
+    void startSelfTest();
+    bool selfTest(Task& task);
+    void finishSelfTest();
+    const char* alertName(Alert alert) { return (alert == alertNone) ? "no" : ((alert == alertBatteryLow) ? "batt" : "fan"); }
     
     /********************************************************************
      * Fan data
@@ -88,26 +113,43 @@ private:
      // The current fan speed selected by the user.
     FanSpeed currentFanSpeed;
 
-    // After we change the fan speed, we stop checking the RPMs for a few seconds, to let the speed stabilize.
+    // After we change the fan speed, we stop checking the RPMs until the speed settles.
     unsigned long lastFanSpeedChangeMilliSeconds;
     bool fanSpeedRecentlyChanged;
 
+    /********************************************************************
+     * Fan health data
+     ********************************************************************/
+
+    // Estimates how clogged the filter is, from the fan's RPM and current.
+    FilterMonitor filterMonitor;
+    PeriodicCallback fanHealthCheck; // a timer that periodically triggers onFanHealthCheck()
+    bool filterReminderOn;           // is the filter reminder requested?
+
     /********************************************************************
      * Alert data
      ********************************************************************/
 
-     // Data used when an alert is active.
-    Alert currentAlert;
-    const int* currentAlertLEDs = nullptr;
-    const int* currentAlertMillis = nullptr;
-    bool alertToggle;
+    // Which alerts are active: bit (1 << alert) for each one. The alerts are independent, so the battery can
+    // run low during a fan alert. AlertSequencer plays the most urgent one, which is what getCurrentAlert() returns.
+    byte activeAlerts;
+    int batteryAlertPercent; // the battery level when the low battery alert started
 
-    // The timer that pulses the lights and buzzer during an alert.
-    Timer alertTimer;
+    // The object that pulses the lights and buzzer during an alert, the power off warning,
+    // the reminder beeps when the battery gets below 15%, and the flashes after an unusual reset.
+    AlertSequencer alertSequencer;
 
-    // The timer that does the reminder beeps when the battery gets below 15%.
-    PeriodicCallback chargeReminder;
-    Timer beepTimer;
+    /********************************************************************
+     * Self-test data
+     ********************************************************************/
+
+    // The power-on self-test. It runs in the background while the fan spins up.
+    Task selfTestTask;
+    unsigned long selfTestStartMillis; // when setup() started
+    byte selfTestFailures;             // a set of SelfTestCheck bits
+
+    // Noteworthy events, such as self-test failures, that we keep in EEPROM.
+    FlightLog flightLog;
 
     /********************************************************************
      * Etc.
@@ -119,12 +161,18 @@ private:
     // This object keeps track of the battery state-of-charge.
     Battery battery;
 
+    // Lifetime statistics, such as hours of use and alert counts, that we keep in EEPROM.
+    UsageCounters usage;
+
     // Data for the periodic status reports that we send to the serial port. 
     // For testing and debugging use.
     int ledState[numLEDs];          // the current state of the LEDs
     int buzzerState;                // the current state of the buzzer
     PeriodicCallback statusReport;  // a timer that periodically triggers a status report
 
+    // The bench port on the ISP header, for reading our state and changing our settings.
+    SPIPort spiPort;
+
 public:
     // Glue
     static Main* instance;   // the one and only instance of Main.
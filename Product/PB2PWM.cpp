@@ -41,3 +41,14 @@ void stopPB2PWM() {
     OCR1B = 0;
 }
 
+bool testPB2PWM(long frequencyHz)
+{
+    startPB2PWM(frequencyHz, 0);
+    const bool ok = (TCCR1A == (_BV(COM1B1) | _BV(WGM10) | _BV(WGM11))) &&
+                    ((TCCR1B & (_BV(WGM13) | _BV(CS10))) == (_BV(WGM13) | _BV(CS10))) &&
+                    (OCR1A == F_CPU / (2 * frequencyHz)) &&
+                    (OCR1B == 0);
+    stopPB2PWM();
+    return ok;
+}
+
@@ -6,3 +6,8 @@ void startPB2PWM(long frequencyHz, int dutyCyclePercent);
 // Stop generating a PWM signal on pin PB2
 void stopPB2PWM();
 
+// For the power-on self-test: set up the timer for the given frequency, with a duty cycle of 0 so the
+// pin stays low, and check that the timer registers took the values. Then stop the timer.
+// Returns true if the timer is OK.
+bool testPB2PWM(long frequencyHz);
+
@@ -7,7 +7,7 @@ extern unsigned long getMillis();
 
 class PeriodicCallback {
 public:
-    PeriodicCallback(unsigned long intervalMillis, void (*callback)()) : _intervalMillis(intervalMillis), _callback(callback), _active(false) {}
+    PeriodicCallback(unsigned long intervalMillis, void (*callback)()) : _intervalMillis(intervalMillis), _active(false), _callback(callback) {}
 
     void start() {
         _active = true;
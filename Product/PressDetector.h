@@ -57,4 +57,10 @@ public:
     {
         return _currentState;
     }
+
+    // Change how long the button must be held.
+    void setRequiredMillis(unsigned long requiredMillis)
+    {
+        _requiredMillis = requiredMillis;
+    }
 };
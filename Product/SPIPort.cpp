@@ -0,0 +1,206 @@
+/*
+ * SPIPort.cpp
+ */
+#include "SPIPort.h"
+
+#define hw Hardware::instance
+
+SPIPort::SPIPort(void (*getTelemetry)(SPITelemetry& telemetry), byte (*getRecord)(byte kind, byte age, byte* data)) :
+    getTelemetry(getTelemetry),
+    getRecord(getRecord),
+    on(false),
+    selecting(false),
+    waitingForRelease(false),
+    configRejected(false),
+    inFrame(false),
+    unlocked(false),
+    pendingCommand(0)
+{ }
+
+void SPIPort::update(bool allowed)
+{
+    const unsigned long now = hw.millis();
+    const bool selected = (hw.digitalRead(SPI_SCK_PIN) == LOW);
+    if (!selected) {
+        selecting = false;
+        waitingForRelease = false;
+    }
+    if (!allowed) {
+        if (on) {
+            stop();
+        }
+        return;
+    }
+
+    if (selected) {
+        lastSelectMillis = now;
+        if (!on && !waitingForRelease) {
+            if (!selecting) {
+                selecting = true;
+                selectStartMillis = now;
+            } else if (now - selectStartMillis >= SPI_SELECT_MILLIS) {
+                turnOn();
+            }
+        }
+    } else if (on && now - lastSelectMillis >= SPI_RELEASE_MILLIS) {
+        turnOff();
+    }
+    if (on && !unlocked && now - onMillis >= SPI_UNLOCK_MILLIS) {
+        stop();
+    }
+    if (!on) {
+        return;
+    }
+
+    const byte command = pendingCommand;
+    if (command == 'S') {
+        ConfigData checked = stagedConfig;
+        configRejected = (checked.version != CONFIG_VERSION || Config::validate(checked) != 0);
+        if (!configRejected) {
+            config.save(stagedConfig);
+        }
+    } else if (command == 'E') {
+        configRejected = false;
+        config.erase();
+    } else if (command == 'L') {
+        // The host doesn't read the record registers until the command is done, so we can fill them in directly.
+        record.kind = pendingKind;
+        record.age = pendingAge;
+        record.size = getRecord(pendingKind, pendingAge, record.data);
+    }
+    if (command) {
+        pendingCommand = 0;
+    }
+
+    if (!inFrame) {
+        refreshTelemetry();
+    }
+}
+
+void SPIPort::stop()
+{
+    turnOff();
+    selecting = false;
+    waitingForRelease = (hw.digitalRead(SPI_SCK_PIN) == LOW);
+}
+
+void SPIPort::turnOn()
+{
+    on = true;
+    onMillis = hw.millis();
+    inFrame = false;
+    unlocked = false;
+    pendingCommand = 0;
+    configRejected = false;
+    phase = phaseCommand;
+    stagedConfig = config;
+    memset(&record, 0, sizeof(record));
+    refreshTelemetry();
+    hw.setSPISlaveInterruptCallback(this);
+    hw.writeSPIData(SPI_READY);
+}
+
+void SPIPort::turnOff()
+{
+    hw.setSPISlaveInterruptCallback(0);
+    on = false;
+}
+
+// Get the latest telemetry. We only copy it in between frames, so the host never sees a mixture of old and new values.
+// The copy takes about 50 microseconds, which is why the host has to wait between bytes.
+void SPIPort::refreshTelemetry()
+{
+    SPITelemetry latest;
+    getTelemetry(latest);
+    latest.protocolVersion = SPI_PROTOCOL_VERSION;
+    latest.flags &= ~(SPI_FLAG_CONFIG_OVERRIDDEN | SPI_FLAG_COMMAND_PENDING | SPI_FLAG_CONFIG_REJECTED);
+    if (config.isOverridden()) {
+        latest.flags |= SPI_FLAG_CONFIG_OVERRIDDEN;
+    }
+    if (configRejected) {
+        latest.flags |= SPI_FLAG_CONFIG_REJECTED;
+    }
+
+    noInterrupts();
+    if (!inFrame) {
+        if (pendingCommand) {
+            latest.flags |= SPI_FLAG_COMMAND_PENDING;
+        }
+        telemetry = latest;
+    }
+    interrupts();
+}
+
+byte SPIPort::readRegister(byte address)
+{
+    if (!unlocked) {
+        return 0;
+    }
+    if (address < sizeof(SPITelemetry)) {
+        return ((const byte*)&telemetry)[address];
+    }
+    if (address >= SPI_CONFIG_ADDRESS && (byte)(address - SPI_CONFIG_ADDRESS) < sizeof(ConfigData)) {
+        return ((const byte*)&stagedConfig)[address - SPI_CONFIG_ADDRESS];
+    }
+    if (address >= SPI_RECORD_ADDRESS && (byte)(address - SPI_RECORD_ADDRESS) < sizeof(SPIRecord)) {
+        return ((const byte*)&record)[address - SPI_RECORD_ADDRESS];
+    }
+    return 0;
+}
+
+void SPIPort::writeRegister(byte address, byte data)
+{
+    if (unlocked && address >= SPI_CONFIG_ADDRESS && (byte)(address - SPI_CONFIG_ADDRESS) < sizeof(ConfigData)) {
+        ((byte*)&stagedConfig)[address - SPI_CONFIG_ADDRESS] = data;
+    }
+}
+
+// This gets called by the SPI interrupt each time the host has sent a byte. We have to choose the byte that the
+// host will get next, before the host starts sending it.
+void SPIPort::callback()
+{
+    const byte received = hw.readSPIData();
+    switch (phase) {
+        case phaseCommand:
+            command = received;
+            inFrame = true;
+            phase = phaseAddress;
+            break;
+
+        case phaseAddress:
+            address = received;
+            phase = phaseLength;
+            break;
+
+        case phaseLength:
+            // The 'L' command's "length" is really an age, so it has no data bytes.
+            remaining = (command == 'L') ? 0 : received;
+            length = received;
+            phase = phaseData;
+            break;
+
+        case phaseData:
+            if (command == 'W') {
+                writeRegister(address, received);
+            }
+            address += 1;
+            remaining -= 1;
+            break;
+    }
+
+    if (phase == phaseData && remaining == 0) {
+        // The frame is finished.
+        if (command == 'U' && address == SPI_UNLOCK_KEY) {
+            unlocked = true;
+        } else if (unlocked && (command == 'S' || command == 'E' || command == 'L')) {
+            pendingKind = address;
+            pendingAge = length;
+            pendingCommand = command;
+            telemetry.flags |= SPI_FLAG_COMMAND_PENDING;
+        }
+        phase = phaseCommand;
+        inFrame = false;
+    }
+
+    hw.writeSPIData((phase == phaseCommand) ? SPI_READY : ((phase == phaseData && command == 'R') ? readRegister(address) : 0));
+}
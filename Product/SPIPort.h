@@ -0,0 +1,169 @@
+#pragma once
+/*
+ * SPIPort.h
+ *
+ * The SPI port lets a host on the bench read the firmware's live state and usage counters, and change its
+ * settings, through the 6-pin ISP header. The serial port can't do this, because its receive pin is
+ * also CHARGER_CONNECTED_PIN.
+ *
+ * The port only works while the power is off, because the buzzer pin is also the SPI's slave select pin, and
+ * the buzzer has to be free to sound the alarms while the PAPR is in use. If the buzzer has to sound while the
+ * port is on, the port turns off.
+ *
+ * Selecting the port takes a deliberate handshake, so that a stray low on SCK can't take over the buzzer pin:
+ *   1. Hold SCK low, which is where SCK idles in SPI mode 0, for at least SPI_SELECT_MILLIS. (When no host is
+ *      connected, the pullup holds it high.) While the firmware naps, it wakes up once a second, and if SCK is low
+ *      it stays awake at full power. Then it turns on the MCU's SPI in slave mode. So with the power off and no
+ *      charger, allow up to a second more.
+ *   2. Within SPI_UNLOCK_MILLIS, send a 'U' frame with the address SPI_UNLOCK_KEY and a length of 0. Until then,
+ *      reads return 0 and the other commands do nothing. If the port isn't unlocked in time, it turns off, and
+ *      the host has to let go of SCK and start again.
+ * When the host lets go of SCK for SPI_RELEASE_MILLIS, the port turns off again.
+ *
+ * The host uses SPI mode 0, most significant bit first, at up to 2 MHz (F_CPU / 4). Each byte is handled by an
+ * interrupt, so the host must wait at least 100 microseconds after each byte. Every transfer is a frame:
+ *
+ *     command, address, length, then "length" data bytes
+ *
+ * The commands are:
+ *     'R' read "length" registers starting at "address". The slave sends them during the data bytes.
+ *     'W' write the data bytes into the registers starting at "address". Only the config registers can be written.
+ *     'S' save the config registers in EEPROM. They take effect the next time the MCU starts up.
+ *     'E' erase the settings in EEPROM, so the defaults take effect the next time the MCU starts up.
+ *     'U' unlock the port (see above).
+ *     'L' load a record from EEPROM into the record registers. Send an SPIRecordKind as the address, the record's
+ *         age (0 is the newest) as the length, and no data bytes. The load takes a few milliseconds, and
+ *         SPI_FLAG_COMMAND_PENDING is set until it's done.
+ * For 'S' and 'E', send an address and length of 0. The save or erase takes a few milliseconds, and
+ * SPI_FLAG_COMMAND_PENDING is set until it's done. 'S' only saves the config registers if they have the right
+ * version and every setting is in range (see Config::validate()). Otherwise it sets SPI_FLAG_CONFIG_REJECTED,
+ * which stays set until the next 'S' or 'E'.
+ *
+ * While the host sends the command byte, the slave sends SPI_READY. If the host gets something else,
+ * the host and slave don't agree on where the frames begin. Let go of SCK and select the port again.
+ *
+ * The registers are bytes, numbered from 0. Multi-byte values are little-endian.
+ *     0 to sizeof(SPITelemetry) - 1: the SPITelemetry, read only
+ *     SPI_CONFIG_ADDRESS onwards: a ConfigData (see Config.h). This starts out as the settings in use.
+ *     SPI_RECORD_ADDRESS onwards: the SPIRecord that the last 'L' command loaded, read only.
+ * This is how to read the flight log and the fan health statistics from a product build, which has no serial port.
+ * To read a whole log, load ages 0, 1, 2... until a record comes back with a size of 0.
+ */
+#include "Hardware.h"
+#include "Config.h"
+#include "UsageCounters.h"
+
+// The version of the protocol and register layout. Change this whenever you change either of them.
+const byte SPI_PROTOCOL_VERSION = 3;
+
+const byte SPI_READY = 0xA5;
+const byte SPI_UNLOCK_KEY = 0x5A;
+const byte SPI_CONFIG_ADDRESS = 0x80;
+const byte SPI_RECORD_ADDRESS = 0xD0;
+const unsigned long SPI_SELECT_MILLIS = 1000;
+const unsigned long SPI_UNLOCK_MILLIS = 2000;
+const unsigned long SPI_RELEASE_MILLIS = 100;
+
+// Bits in SPITelemetry::flags
+const byte SPI_FLAG_CHARGING = 1 << 0;        // the charger is connected
+const byte SPI_FLAG_REPLACE_FILTER = 1 << 1;  // the filter reminder is on
+const byte SPI_FLAG_CONFIG_OVERRIDDEN = 1 << 2; // the settings in use came from EEPROM
+const byte SPI_FLAG_COMMAND_PENDING = 1 << 3; // an 'S', 'E', or 'L' command hasn't been done yet
+const byte SPI_FLAG_CONFIG_REJECTED = 1 << 4; // the last 'S' command didn't save, because of a bad setting
+const byte SPI_FLAG_BATTERY_ALERT = 1 << 5;  // the low battery alert is on, even if a more urgent alert is the one playing
+
+// The live state, as the host sees it.
+struct SPITelemetry {
+    byte protocolVersion; // SPI_PROTOCOL_VERSION
+    byte state;           // a PAPRState
+    byte fanSpeed;        // a FanSpeed
+    byte alert;           // an Alert: the most urgent one that's active
+    byte flags;           // SPI_FLAG_ bits
+    byte batteryPercent;
+    uint16_t fanRPM;
+    long milliVolts;
+    long milliAmps;       // positive when charging
+    long coulombs;        // the charge in the battery
+    int minutesRemaining; // -1 if unknown
+    int minutesToFull;    // -1 if unknown
+    int filterRestriction; // see FilterMonitor::getRestrictionIndex()
+    UsageRecord usage;
+};
+
+// The kinds of record that the 'L' command can load.
+enum SPIRecordKind {
+    spiRecordFlightLog,   // a FlightLogEntry (see FlightLog.h)
+    spiRecordFanHealthHour, // a FanHealthRecord (see FanController.h)
+    spiRecordFanHealthDay // a FanHealthDayRecord (see FanController.h)
+};
+
+// A record loaded from EEPROM, as the host sees it. SPI_RECORD_DATA_SIZE must be at least the size of the biggest
+// kind of record.
+const byte SPI_RECORD_DATA_SIZE = 24;
+struct SPIRecord {
+    byte kind; // an SPIRecordKind
+    byte age;
+    byte size; // how many bytes of data there are, or 0 if there's no such record
+    byte data[SPI_RECORD_DATA_SIZE];
+};
+
+class SPIPort : public InterruptCallback {
+public:
+    // The port calls "getTelemetry" to fill in the telemetry. The caller doesn't need to set protocolVersion, or
+    // the SPI_FLAG_CONFIG_OVERRIDDEN and SPI_FLAG_COMMAND_PENDING flags. It calls "getRecord" to load a record
+    // for the 'L' command. "getRecord" copies the record into "data", and returns its size, or 0 if there's
+    // no such record.
+    SPIPort(void (*getTelemetry)(SPITelemetry& telemetry), byte (*getRecord)(byte kind, byte age, byte* data));
+
+    // Call this from loop(). It turns the port on and off, keeps the telemetry up to date, and does
+    // the 'S' and 'E' commands. "allowed" says whether the port may be on: pass true only while the power is off.
+    void update(bool allowed);
+
+    // Is a host connected?
+    bool isOn() { return on; }
+
+    // Is a host connected, or in the middle of selecting the port?
+    bool isActive() { return on || selecting; }
+
+    // Turn the port off right away, to free the buzzer pin. The host has to select the port again.
+    void stop();
+
+    // Handler for the SPI interrupt.
+    virtual void callback();
+
+private:
+    enum FramePhase { phaseCommand, phaseAddress, phaseLength, phaseData };
+
+    void turnOn();
+    void turnOff();
+    void refreshTelemetry();
+    byte readRegister(byte address);
+    void writeRegister(byte address, byte data);
+
+    void (*getTelemetry)(SPITelemetry& telemetry);
+    byte (*getRecord)(byte kind, byte age, byte* data);
+    bool on;
+    bool selecting;                 // SCK has been low since selectStartMillis
+    bool waitingForRelease;         // we turned off while SCK was low, and it hasn't gone high since
+    bool configRejected;            // the last 'S' command didn't save
+    unsigned long selectStartMillis;
+    unsigned long lastSelectMillis; // when we last saw SCK low
+    unsigned long onMillis;         // when the port turned on
+
+    // These are shared with the interrupt handler.
+    SPITelemetry telemetry;
+    ConfigData stagedConfig;       // the config registers
+    SPIRecord record;              // the record registers
+    volatile bool inFrame;         // the host is in the middle of a frame
+    volatile bool unlocked;        // the host has sent the 'U' frame
+    volatile byte pendingCommand;  // an 'S', 'E', or 'L' command for update() to do, or 0
+    byte pendingKind;              // the 'L' command's record kind and age
+    byte pendingAge;
+
+    // These are only used by the interrupt handler.
+    FramePhase phase;
+    byte command;
+    byte address;
+    byte length;
+    byte remaining;
+};
@@ -0,0 +1,75 @@
+// A minimal cooperative task utility, in the style of "protothreads". A task is a function that
+// is written as straight-line code, but which can pause (for example to wait a few hundred milliseconds)
+// and give control back to loop(). The next time loop() calls update(), the function resumes
+// where it left off. This lets us write animations and other sequences without using delay(),
+// so everything else in loop() keeps running at its normal rate.
+//
+// The function is called with the Task object, and must look like this:
+//
+//     bool myTaskFunction(Task& task) {
+//         TASK_BEGIN(task);
+//         ... code that can use TASK_YIELD, TASK_WAIT_UNTIL, and TASK_DELAY ...
+//         TASK_END(task);
+//     }
+//
+// Be careful: the function returns each time it pauses, so local variables DO NOT keep their values
+// across a pause. Keep any such state in static or member variables. Also, you cannot pause inside
+// a switch statement, and you can't put two TASK_ macros on the same line.
+#pragma once
+
+extern unsigned long getMillis();
+
+class Task {
+public:
+    Task(bool (*function)(Task& task)) : _function(function), _active(false) {}
+
+    // Start the task from the beginning. The task begins running the next time you call update().
+    void start() {
+        resumePoint = 0;
+        _active = true;
+    }
+
+    // Stop the task, wherever it is.
+    void stop() {
+        _active = false;
+    }
+
+    // Is the task running?
+    bool isActive() {
+        return _active;
+    }
+
+    // call this from loop()
+    void update() {
+        if (_active) {
+            _active = (*_function)(*this);
+        }
+    }
+
+    // These are used by the TASK_ macros. Don't use them directly.
+    unsigned int resumePoint;
+    unsigned long waitStartMillis;
+
+private:
+    bool (*_function)(Task& task);
+    bool _active;
+};
+
+// Begin the body of a task function.
+#define TASK_BEGIN(task) switch ((task).resumePoint) { case 0:
+
+// Give control back to loop(). Next time, continue from here.
+#define TASK_YIELD(task) \
+    do { (task).resumePoint = __LINE__; return true; case __LINE__:; } while (0)
+
+// Give control back to loop() until the condition is true.
+#define TASK_WAIT_UNTIL(task, condition) \
+    do { (task).resumePoint = __LINE__; case __LINE__: if (!(condition)) return true; } while (0)
+
+// Give control back to loop() for the given number of milliseconds.
+#define TASK_DELAY(task, millis) \
+    do { (task).waitStartMillis = getMillis(); \
+         TASK_WAIT_UNTIL(task, getMillis() - (task).waitStartMillis >= (unsigned long)(millis)); } while (0)
+
+// End the body of a task function. The task stops running when it gets here.
+#define TASK_END(task) } return false
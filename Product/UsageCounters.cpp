@@ -0,0 +1,128 @@
+/*
+ * UsageCounters.cpp
+ */
+#include "UsageCounters.h"
+#include "MySerial.h"
+
+#define hw Hardware::instance
+
+// We save the counters when something interesting happens, but not more often than this. With 2 slots in
+// the journal, this keeps the EEPROM good for several years even if the user keeps turning the unit on and off.
+const unsigned long USAGE_MIN_SAVE_MILLIS = 15UL * 60UL * 1000UL;
+
+// If nothing interesting happens, we save the counters this often anyway.
+const unsigned long USAGE_PERIODIC_SAVE_MILLIS = 4UL * 60UL * 60UL * 1000UL;
+
+// The first save after startup happens sooner, so that short sessions get counted. It's not right away, so that
+// a unit that resets every few seconds doesn't wear out the EEPROM. The resets themselves are saved right away,
+// in resetJournal. That's only 10 bytes per reset, and with 2 slots it lasts for 200,000 resets.
+const unsigned long USAGE_FIRST_SAVE_MILLIS = 60UL * 1000UL;
+
+const long long PICO_COULOMBS_PER_COULOMB = 1000000000000LL;
+
+UsageCounters::UsageCounters() :
+    journal(EEPROM_USAGE_COUNTERS_ADDRESS, EEPROM_USAGE_COUNTERS_SIZE, sizeof(UsageRecord)),
+    resetJournal(EEPROM_RESET_COUNTS_ADDRESS, EEPROM_RESET_COUNTS_SIZE, sizeof(counters.resetCounts))
+{ }
+
+void UsageCounters::begin()
+{
+    if (!journal.read(&counters)) {
+        memset(&counters, 0, sizeof(counters));
+    }
+    // The reset counts in resetJournal are never older than the ones in journal.
+    unsigned int resetCounts[numUsageResets];
+    if (resetJournal.read(resetCounts)) {
+        memcpy(counters.resetCounts, resetCounts, sizeof(resetCounts));
+    }
+    lastUpdateMillis = hw.millis();
+    lastSaveMillis = lastUpdateMillis;
+    savedSinceStartup = false;
+    pendingInPicoCoulombs = 0;
+    pendingOutPicoCoulombs = 0;
+}
+
+void UsageCounters::countReset(int resetFlags)
+{
+    // A manual reset jumps to the reset vector without setting any flags.
+    if (resetFlags == 0) {
+        counters.resetCounts[usageResetManual] += 1;
+    }
+    if (resetFlags & (1 << PORF)) {
+        counters.resetCounts[usageResetPowerOn] += 1;
+    }
+    if (resetFlags & (1 << EXTRF)) {
+        counters.resetCounts[usageResetExternal] += 1;
+    }
+    if (resetFlags & (1 << BORF)) {
+        counters.resetCounts[usageResetBrownOut] += 1;
+    }
+    if (resetFlags & (1 << WDRF)) {
+        counters.resetCounts[usageResetWatchdog] += 1;
+    }
+    resetJournal.write(counters.resetCounts);
+}
+
+void UsageCounters::countEvent(UsageEvent event)
+{
+    counters.eventCounts[event] += 1;
+}
+
+void UsageCounters::addCharge(long long inPicoCoulombs, long long outPicoCoulombs)
+{
+    pendingInPicoCoulombs += inPicoCoulombs;
+    const unsigned long coulombsIn = pendingInPicoCoulombs / PICO_COULOMBS_PER_COULOMB;
+    counters.coulombsIn += coulombsIn;
+    pendingInPicoCoulombs -= coulombsIn * PICO_COULOMBS_PER_COULOMB;
+
+    pendingOutPicoCoulombs += outPicoCoulombs;
+    const unsigned long coulombsOut = pendingOutPicoCoulombs / PICO_COULOMBS_PER_COULOMB;
+    counters.coulombsOut += coulombsOut;
+    pendingOutPicoCoulombs -= coulombsOut * PICO_COULOMBS_PER_COULOMB;
+}
+
+void UsageCounters::update(byte state, int fanSpeed)
+{
+    // Count whole seconds, and leave the remainder for next time.
+    const unsigned long now = hw.millis();
+    const unsigned long seconds = (now - lastUpdateMillis) / 1000UL;
+    if (seconds > 0) {
+        lastUpdateMillis += seconds * 1000UL;
+        counters.stateSeconds[state] += seconds;
+        if (fanSpeed >= 0) {
+            counters.fanSpeedSeconds[fanSpeed] += seconds;
+        }
+    }
+
+    if (now - lastSaveMillis >= (savedSinceStartup ? USAGE_PERIODIC_SAVE_MILLIS : USAGE_FIRST_SAVE_MILLIS)) {
+        save();
+    }
+}
+
+void UsageCounters::maybeSave()
+{
+    if (hw.millis() - lastSaveMillis >= (savedSinceStartup ? USAGE_MIN_SAVE_MILLIS : USAGE_FIRST_SAVE_MILLIS)) {
+        save();
+    }
+}
+
+void UsageCounters::save()
+{
+    journal.write(&counters);
+    lastSaveMillis = hw.millis();
+    savedSinceStartup = true;
+}
+
+void UsageCounters::dump()
+{
+    serialPrintf("usage,stateSeconds,%lu,%lu,%lu,%lu", counters.stateSeconds[0], counters.stateSeconds[1],
+        counters.stateSeconds[2], counters.stateSeconds[3]);
+    serialPrintf("usage,fanSpeedSeconds,%lu,%lu,%lu", counters.fanSpeedSeconds[0], counters.fanSpeedSeconds[1],
+        counters.fanSpeedSeconds[2]);
+    serialPrintf("usage,coulombsIn,%lu,coulombsOut,%lu", counters.coulombsIn, counters.coulombsOut);
+    serialPrintf("usage,alerts,battery,%u,fan,%u,filter,%u", counters.eventCounts[usageBatteryAlert],
+        counters.eventCounts[usageFanAlert], counters.eventCounts[usageFilterReminder]);
+    serialPrintf("usage,resets,powerOn,%u,external,%u,brownOut,%u,watchdog,%u,manual,%u",
+        counters.resetCounts[usageResetPowerOn], counters.resetCounts[usageResetExternal], counters.resetCounts[usageResetBrownOut],
+        counters.resetCounts[usageResetWatchdog], counters.resetCounts[usageResetManual]);
+}
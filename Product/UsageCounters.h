@@ -0,0 +1,77 @@
+#pragma once
+/*
+ * UsageCounters.h
+ *
+ * The usage counters are lifetime statistics for a unit: how long it has spent in each state and at each fan speed,
+ * how much charge has gone into and out of the battery, how many alerts it has raised, and what kinds of reset
+ * it has had. We use them to size batteries and plan service intervals for the fleet.
+ *
+ * The counters are kept in RAM, and saved in EEPROM from time to time, so a few minutes of counts are lost if
+ * the battery is disconnected. The reset counts are the exception: they're saved in a small journal of their own
+ * as soon as they're counted, so a unit that keeps resetting still counts every reset.
+ * Call update() from loop() so the time and charge get counted.
+ */
+#include "EEPROMJournal.h"
+
+const int USAGE_NUM_STATES = 4;     // one for each PAPRState
+const int USAGE_NUM_FAN_SPEEDS = 3; // one for each FanSpeed
+
+// The events that we count.
+enum UsageEvent { usageBatteryAlert, usageFanAlert, usageFilterReminder, numUsageEvents };
+
+// The kinds of reset that we count.
+enum UsageReset { usageResetPowerOn, usageResetExternal, usageResetBrownOut, usageResetWatchdog, usageResetManual, numUsageResets };
+
+// This is what we save in EEPROM.
+struct UsageRecord {
+    unsigned long stateSeconds[USAGE_NUM_STATES];        // time spent in each PAPRState
+    unsigned long fanSpeedSeconds[USAGE_NUM_FAN_SPEEDS]; // time spent with the fan running at each FanSpeed
+    unsigned long coulombsIn;                            // charge that has flowed into the battery
+    unsigned long coulombsOut;                           // charge that has flowed out of the battery
+    unsigned int eventCounts[numUsageEvents];            // indexed by UsageEvent
+    unsigned int resetCounts[numUsageResets];            // indexed by UsageReset
+};
+
+class UsageCounters {
+public:
+    UsageCounters();
+
+    // Call this once at startup, before calling any other functions. It reads the counters from EEPROM.
+    void begin();
+
+    // Count a reset, given the reset flags that Hardware::watchdogStartup() returned, and save the reset counts.
+    void countReset(int resetFlags);
+
+    // Count an event.
+    void countEvent(UsageEvent event);
+
+    // Add the charge that has flowed into and out of the battery. Both amounts are positive.
+    void addCharge(long long inPicoCoulombs, long long outPicoCoulombs);
+
+    // Count the time since the last call. "state" is the PAPRState we were in during that time. If the fan was
+    // running, "fanSpeed" is its FanSpeed, otherwise it's -1. This also saves the counters once in a while,
+    // even when nothing else is happening.
+    void update(byte state, int fanSpeed);
+
+    // Save the counters in EEPROM, unless we saved them very recently. Call this when something
+    // interesting happens, such as a change of state.
+    void maybeSave();
+
+    // Get the counters.
+    const UsageRecord& getCounters() { return counters; }
+
+    // Write the counters to the serial port, as a line of comma separated values.
+    void dump();
+
+private:
+    void save();
+
+    UsageRecord counters;
+    EEPROMJournal journal;
+    EEPROMJournal resetJournal;       // just counters.resetCounts
+    unsigned long lastUpdateMillis;   // the millis() time that the time counters are up to
+    unsigned long lastSaveMillis;     // when we last saved the counters, or when we started up
+    bool savedSinceStartup;
+    long long pendingInPicoCoulombs;  // charge that hasn't added up to a whole coulomb yet
+    long long pendingOutPicoCoulombs;
+};
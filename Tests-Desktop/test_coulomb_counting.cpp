@@ -0,0 +1,174 @@
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include "../Product/CurrentIntegrator.h"
+
+// A benchmark for the coulomb counting in Product. It feeds one hour of a synthetic battery current through
+// two integrators, and compares what each one counts with the true charge:
+//
+//   - the old method: once per pass through loop(), read the current with a single conversion, smooth it with a
+//     10:1 IIR filter, and multiply by the time since the last pass (a rectangle). loop() takes anywhere
+//     from 3 to 300 milliseconds, depending on what else is going on.
+//   - the current method (Hardware.cpp): every 4 Timer 0 ticks, a burst of 16 conversions of the current pin and
+//     16 of the reference pin, timestamped at the start of the burst, and the trapezoids between the bursts. The
+//     arithmetic is the same code, from CurrentIntegrator.h. Only the ADC and the timing are simulated here.
+//
+// The current steps between 0.45 and 1.1 amps of discharge every 5 to 60 seconds, like the fan changing speed and
+// the load changing with the filter and the user's breathing. On top of that there is 50 mA of ripple at 120 Hz,
+// and each conversion has about 4 ADC units (26 mA) of noise. The random numbers come from a fixed seed, so the
+// results are the same every time.
+//
+// When this was written, the old method counted 0.132% too little discharge, and the current method 0.003%.
+
+namespace {
+
+// From Hardware.h and Hardware.cpp.
+const double NANO_AMPS_PER_CHARGE_FLOW_UNIT = 6516781.0;
+const int64_t TIMER0_TICK_MICROS = 2048;
+const int FAST_TICKS_PER_BURST = 4;
+const int FAST_CURRENT_CONVERSIONS = 16;
+const int64_t CONVERSION_MICROS = 104;
+
+// The profile.
+const int64_t PROFILE_MICROS = 3600LL * 1000000LL;
+const double MIN_AMPS = 0.45;
+const double MAX_AMPS = 1.1;
+const int64_t MIN_STEP_MICROS = 5LL * 1000000LL;
+const int64_t MAX_STEP_MICROS = 60LL * 1000000LL;
+const double RIPPLE_AMPS = 0.05;
+const double RIPPLE_HZ = 120.0;
+const double NOISE_UNITS = 4.0;
+const int64_t MIN_LOOP_MICROS = 3000;
+const int64_t MAX_LOOP_MICROS = 300000;
+const double PI = 3.14159265358979323846;
+
+// A small, repeatable random number generator.
+class Random {
+public:
+    explicit Random(uint32_t seed) : state(seed) {}
+
+    // A uniform number in [0, 1).
+    double uniform() {
+        state = state * 1664525u + 1013904223u;
+        return (state >> 8) / 16777216.0;
+    }
+
+    int64_t between(int64_t low, int64_t high) {
+        return low + (int64_t)(uniform() * (double)(high - low));
+    }
+
+    // A normally distributed number, by the Box-Muller method.
+    double normal(double sigma) {
+        const double u1 = 1.0 - uniform();
+        const double u2 = uniform();
+        return sigma * std::sqrt(-2.0 * std::log(u1)) * std::cos(2.0 * PI * u2);
+    }
+
+private:
+    uint32_t state;
+};
+
+// The battery current, as a series of steps plus ripple. Positive when charging, so it's negative here.
+class CurrentProfile {
+public:
+    explicit CurrentProfile(uint32_t seed) : random(seed), stepCount(0) {
+        int64_t t = 0;
+        while (t < PROFILE_MICROS && stepCount < MAX_STEPS) {
+            stepStart[stepCount] = t;
+            stepAmps[stepCount] = -(MIN_AMPS + random.uniform() * (MAX_AMPS - MIN_AMPS));
+            stepCount += 1;
+            t += random.between(MIN_STEP_MICROS, MAX_STEP_MICROS);
+        }
+    }
+
+    double ampsAt(int64_t micros) const {
+        const int step = (int)(std::upper_bound(stepStart, stepStart + stepCount, micros) - stepStart) - 1;
+        return stepAmps[step] + RIPPLE_AMPS * std::sin(2.0 * PI * RIPPLE_HZ * micros / 1e6);
+    }
+
+    // The exact charge over the whole profile, in coulombs.
+    double coulombs() const {
+        double sum = 0;
+        for (int step = 0; step < stepCount; step += 1) {
+            const int64_t end = (step + 1 < stepCount) ? stepStart[step + 1] : PROFILE_MICROS;
+            sum += stepAmps[step] * (end - stepStart[step]) / 1e6;
+        }
+        const double w = 2.0 * PI * RIPPLE_HZ;
+        sum += RIPPLE_AMPS * (1.0 - std::cos(w * PROFILE_MICROS / 1e6)) / w;
+        return sum;
+    }
+
+private:
+    static const int MAX_STEPS = 1000;
+    Random random;
+    int stepCount;
+    int64_t stepStart[MAX_STEPS];
+    double stepAmps[MAX_STEPS];
+};
+
+// One conversion of the current pin minus the reference pin, in ADC units.
+int convert(const CurrentProfile& profile, Random& noise, int64_t micros) {
+    const double units = profile.ampsAt(micros) * 1e9 / NANO_AMPS_PER_CHARGE_FLOW_UNIT;
+    return (int)std::floor(units + noise.normal(NOISE_UNITS) + 0.5);
+}
+
+// The old method, as Battery::update() did it before the sampling interrupt.
+double countWithLoopRectangles(const CurrentProfile& profile) {
+    Random random(2);
+    long long microAmps = 0;
+    long long picoCoulombs = 0;
+    int64_t lastMicros = 0;
+    for (int64_t now = 0; now < PROFILE_MICROS; ) {
+        now = std::min(now + random.between(MIN_LOOP_MICROS, MAX_LOOP_MICROS), PROFILE_MICROS);
+        const long long readingMicroAmps = ((long long)convert(profile, random, now) * (long long)NANO_AMPS_PER_CHARGE_FLOW_UNIT) / 1000LL;
+        const long long lowPassFilterN = 10LL;
+        microAmps = ((microAmps * lowPassFilterN) + readingMicroAmps) / (lowPassFilterN + 1);
+        picoCoulombs += microAmps * (now - lastMicros);
+        lastMicros = now;
+    }
+    return picoCoulombs / 1e12;
+}
+
+// The current method, with the timing of Hardware::onSampleTimer() and the arithmetic of onConversionComplete().
+double countWithSampledTrapezoids(const CurrentProfile& profile) {
+    Random random(3);
+    long long picoCoulombs = 0;
+    long prevScaledUnits = 0;
+    int64_t prevMicros = 0;
+    bool havePrev = false;
+    const int64_t burstMicros = TIMER0_TICK_MICROS * FAST_TICKS_PER_BURST;
+    for (int64_t burst = 0; burst <= PROFILE_MICROS; burst += burstMicros) {
+        long sum = 0;
+        for (int i = 0; i < FAST_CURRENT_CONVERSIONS; i += 1) {
+            sum += convert(profile, random, burst + i * CONVERSION_MICROS);
+        }
+        const long scaledUnits = scaleCurrentSample(sum, FAST_CURRENT_CONVERSIONS);
+        if (havePrev) {
+            // Hardware::takePicoCoulombs() converts the sum whenever Battery::update() asks. We do it after every
+            // burst, so the sum can't overflow; the rounding is less than a picocoulomb each time.
+            picoCoulombs += scaledUnitMicrosToPicoCoulombs(trapezoidScaledUnitMicros(prevScaledUnits, scaledUnits, (long)(burst - prevMicros)),
+                (long long)NANO_AMPS_PER_CHARGE_FLOW_UNIT);
+        }
+        prevScaledUnits = scaledUnits;
+        prevMicros = burst;
+        havePrev = true;
+    }
+    return picoCoulombs / 1e12;
+}
+
+double errorPercent(double counted, double actual) {
+    return (counted - actual) / std::fabs(actual) * 100.0;
+}
+
+} // namespace
+
+TEST(CoulombCounting, SampledTrapezoidsBeatLoopRectangles) {
+    const CurrentProfile profile(1);
+    const double actual = profile.coulombs();
+    const double oldError = errorPercent(countWithLoopRectangles(profile), actual);
+    const double newError = errorPercent(countWithSampledTrapezoids(profile), actual);
+
+    ASSERT_LT(std::fabs(newError), 0.01) << "sampled trapezoids counted " << newError << "% of " << actual << " C";
+    ASSERT_LT(std::fabs(newError), std::fabs(oldError)) << "loop rectangles counted " << oldError << "%";
+}